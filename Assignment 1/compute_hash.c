@@ -7,44 +7,84 @@
 void hash(char *hash_val, long block_size);
 int check_hash(const char *hash1, const char *hash2, long block_size);
 
+// Bulk hashing functions in hash_files.c
+int hash_files(long block_size, char **paths, int npaths);
+int check_manifest(long block_size, const char *path);
+
 #ifndef MAX_BLOCK_SIZE
-    #define MAX_BLOCK_SIZE 1024
+    #define MAX_BLOCK_SIZE (64L * 1024 * 1024)
 #endif
 
+static const char hex_digits[] = "0123456789abcdef";
+
+/* One more than the value of each character as a hex digit, or 0 if it
+ * isn't one.
+ */
+static const unsigned char hex_value[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
 /* Converts hexstr, a string of hexadecimal digits, into hash_val, an an
  * array of char.  Each pair of digits in hexstr is converted to its
- * numeric 8-bit value and stored in an element of hash_val.
+ * numeric 8-bit value and stored in an element of hash_val.  As with
+ * strtol, a pair stops at the first character that isn't a hex digit,
+ * and pairs past the end of a short hexstr are 0.
  * Preconditions:
  *    - hash_val must have enough space to store block_size elements
- *    - hexstr must be block_size * 2 characters in length
  */
 
-void xstr_to_hash(char *hash_val, char *hexstr, int block_size) {
-    for(int i = 0; i < block_size*2; i += 2) {
-        char str[3];
-        str[0] = hexstr[i];
-        str[1] = hexstr[i + 1];
-        str[2] = '\0';
-        hash_val[i/2] = strtol(str, NULL, 16);
+void xstr_to_hash(char *hash_val, char *hexstr, long block_size) {
+    long len = strlen(hexstr);
+    for(long i = 0; i < block_size; i++) {
+        int high = 2 * i < len ? hex_value[(unsigned char)hexstr[2 * i]] : 0;
+        int low = 2 * i + 1 < len ?
+                  hex_value[(unsigned char)hexstr[2 * i + 1]] : 0;
+        if(high == 0) {
+            hash_val[i] = 0;
+        }
+        else if(low == 0) {
+            hash_val[i] = high - 1;
+        }
+        else {
+            hash_val[i] = (high - 1) << 4 | (low - 1);
+        }
     }
 }
 
 // Print the values of hash_val in hex
 void show_hash(char *hash_val, long block_size) {
-    for(int i = 0; i < block_size; i++) {
-        printf("%.2hhx ", hash_val[i]);
+    char line[3 * 4096];
+    long len = 0;
+    for(long i = 0; i < block_size; i++) {
+        unsigned char byte = hash_val[i];
+        line[len++] = hex_digits[byte >> 4];
+        line[len++] = hex_digits[byte & 0xf];
+        line[len++] = ' ';
+        if(len == sizeof(line)) {
+            fwrite(line, 1, len, stdout);
+            len = 0;
+        }
     }
+    fwrite(line, 1, len, stdout);
     printf("\n");
 }
 
 
 int main(int argc, char **argv) {
-    char hash_val[MAX_BLOCK_SIZE] = {'\0'};
+    char *hash_val;
     long block_size;
 
     // Verify if the user inputed correct number of arguments.
-    if(argc > 3 || argc < 2) {
+    int bulk = argc >= 3 && (strcmp(argv[2], "-r") == 0 ||
+                             strcmp(argv[2], "-c") == 0);
+    if((!bulk && (argc > 3 || argc < 2)) || (bulk && argc < 4) ||
+       (bulk && argv[2][1] == 'c' && argc != 4)) {
         printf("Usage: compute_hash BLOCK_SIZE [ COMPARISON_HASH ]\n");
+        printf("       compute_hash BLOCK_SIZE -r PATH...\n");
+        printf("       compute_hash BLOCK_SIZE -c MANIFEST\n");
         return 0;
     }
 
@@ -52,10 +92,26 @@ int main(int argc, char **argv) {
 
     // Verify if the inputed block_size is a valid one.
     if (block_size >= MAX_BLOCK_SIZE || block_size <= 0) {
-        printf("The block size should be a positive integer less than %d.\n", MAX_BLOCK_SIZE);
+        printf("The block size should be a positive integer less than %ld.\n",
+               (long)MAX_BLOCK_SIZE);
         return 0;
     }
 
+    // Hash every file under the given paths, or check the files listed in
+    // a manifest, on a pool of threads.
+    if(bulk && argv[2][1] == 'r') {
+        return hash_files(block_size, argv + 3, argc - 3) != 0;
+    }
+    else if(bulk) {
+        return check_manifest(block_size, argv[3]) != 0;
+    }
+
+    hash_val = calloc(block_size, sizeof(char));
+    if(hash_val == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
     // Obtain input and compute hash value.
     hash(hash_val, block_size);
 
@@ -73,7 +129,11 @@ int main(int argc, char **argv) {
             printf("The 2 hash values would differ.\n");
         }
         else {
-            char hash_comp[block_size];
+            char *hash_comp = malloc(block_size);
+            if(hash_comp == NULL) {
+                perror("malloc");
+                return 1;
+            }
             xstr_to_hash(hash_comp, argv[2], block_size);
             int comp = check_hash(hash_val, hash_comp, block_size);
 
@@ -87,9 +147,11 @@ int main(int argc, char **argv) {
                 printf("The first index the two hash values differ at is %d\n",
                        comp);
             }
+            free(hash_comp);
         }
 
     }
 
+    free(hash_val);
     return 0;
 }
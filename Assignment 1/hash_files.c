@@ -0,0 +1,406 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+// Hash manipulation functions in hash_functions.c
+unsigned char *hash_buffer(long block_size);
+void hash_stream_with(char *hash_val, long block_size, FILE *f,
+                      unsigned char *scratch);
+int check_hash(const char *hash1, const char *hash2, long block_size);
+
+// Defined in compute_hash.c
+void xstr_to_hash(char *hash_val, char *hexstr, long block_size);
+
+// Most files that can be waiting to be hashed or printed at once. Bounds
+// memory use however many files there are.
+#define WINDOW 4096
+
+// Most threads hashing files at once.
+#define MAX_THREADS 64
+
+/* A file to be hashed. Results are kept until every file before it has
+ * been printed, so output comes out in the order the files were found.
+ */
+struct job {
+    char *path;
+    char *expected;     // Hex hash from the manifest, or NULL.
+    char *hash_val;
+    int error;          // errno if the file couldn't be read.
+    int done;
+};
+
+/* Queue shared by the thread finding files, the threads hashing them and
+ * the main thread printing the results. Jobs are numbered in the order
+ * they were added and live in jobs[number % WINDOW].
+ */
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t has_room;    // For the producer: a slot was freed.
+    pthread_cond_t has_work;    // For the workers: a job was queued.
+    pthread_cond_t has_result;  // For the printer: a job was finished.
+    struct job jobs[WINDOW];
+    long queued;
+    long taken;
+    long printed;
+    int finished;               // The producer has queued every file.
+    long block_size;
+    int failures;
+};
+
+// Arguments of the thread that finds the files to hash.
+struct producer {
+    struct pool *pool;
+    char **paths;
+    int npaths;
+    FILE *manifest;
+};
+
+
+/* Reports that the file at path couldn't be hashed because of error, the
+ * way print_job would, and counts it as a failure. Used for errors found
+ * before the file is queued, which are printed out of order.
+ */
+static void report_failure(struct pool *pool, const char *path,
+                           int in_manifest, int error) {
+    fprintf(stderr, "compute_hash: %s: %s\n", path, strerror(error));
+    if(in_manifest) {
+        printf("%s: FAILED open or read\n", path);
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->failures++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Queues a copy of path (and of the hash it's expected to have, if any) to
+ * be hashed, waiting for the printer to catch up if the window is full.
+ */
+static void add_job(struct pool *pool, const char *path,
+                    const char *expected) {
+    char *path_copy = strdup(path);
+    char *expected_copy = expected != NULL ? strdup(expected) : NULL;
+    if(path_copy == NULL || (expected != NULL && expected_copy == NULL)) {
+        free(path_copy);
+        free(expected_copy);
+        report_failure(pool, path, expected != NULL, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->queued - pool->printed >= WINDOW) {
+        pthread_cond_wait(&pool->has_room, &pool->lock);
+    }
+    struct job *job = &pool->jobs[pool->queued % WINDOW];
+    job->path = path_copy;
+    job->expected = expected_copy;
+    job->hash_val = NULL;
+    job->error = 0;
+    job->done = 0;
+    pool->queued++;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Queues every regular file in the tree rooted at path, visiting the
+ * entries of each directory in name order. Symbolic links are only
+ * followed when given on the command line.
+ */
+static void walk(struct pool *pool, const char *path, int top) {
+    struct stat info;
+    int ret = top ? stat(path, &info) : lstat(path, &info);
+    if(ret != 0) {
+        // Let the worker report the error in order with everything else.
+        add_job(pool, path, NULL);
+        return;
+    }
+
+    if(S_ISREG(info.st_mode)) {
+        add_job(pool, path, NULL);
+    }
+    else if(S_ISDIR(info.st_mode)) {
+        struct dirent **names;
+        int n = scandir(path, &names, NULL, alphasort);
+        if(n < 0) {
+            report_failure(pool, path, 0, errno);
+            return;
+        }
+        int pathlen = strlen(path);
+        for(int i = 0; i < n; i++) {
+            const char *name = names[i]->d_name;
+            if(strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+                char *child = malloc(pathlen + strlen(name) + 2);
+                if(child == NULL) {
+                    // The path of the entry can't be put together, so report
+                    // it against the directory.
+                    report_failure(pool, path, 0, ENOMEM);
+                    free(names[i]);
+                    continue;
+                }
+                sprintf(child, "%s%s%s", path,
+                        pathlen > 0 && path[pathlen - 1] == '/' ? "" : "/",
+                        name);
+                walk(pool, child, 0);
+                free(child);
+            }
+            free(names[i]);
+        }
+        free(names);
+    }
+}
+
+/* Queues the files listed in a manifest. Each line is a hash in hex
+ * followed by white space and the path of the file.
+ */
+static void read_manifest(struct pool *pool, FILE *manifest) {
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    long lineno = 0;
+    while((len = getline(&line, &cap, manifest)) != -1) {
+        lineno++;
+        if(len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        char *sep = strpbrk(line, " \t");
+        char *path = sep;
+        while(path != NULL && (*path == ' ' || *path == '\t')) {
+            path++;
+        }
+        if(sep == NULL || sep == line || *path == '\0') {
+            fprintf(stderr, "compute_hash: manifest line %ld is malformed\n",
+                    lineno);
+            pthread_mutex_lock(&pool->lock);
+            pool->failures++;
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        *sep = '\0';
+        add_job(pool, path, line);
+    }
+    free(line);
+}
+
+static void *producer_main(void *arg) {
+    struct producer *producer = arg;
+    struct pool *pool = producer->pool;
+
+    if(producer->manifest != NULL) {
+        read_manifest(pool, producer->manifest);
+    }
+    for(int i = 0; i < producer->npaths; i++) {
+        walk(pool, producer->paths[i], 1);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->finished = 1;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_cond_signal(&pool->has_result);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Hashes queued files until there are none left. Each worker reads every
+ * file it's given into the same buffer. If that or a file's digest can't
+ * be allocated, the file gets ENOMEM as its error, the way a file that
+ * can't be opened gets the error from fopen.
+ */
+static void *worker_main(void *arg) {
+    struct pool *pool = arg;
+    unsigned char *scratch = hash_buffer(pool->block_size);
+
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        while(pool->taken == pool->queued && !pool->finished) {
+            pthread_cond_wait(&pool->has_work, &pool->lock);
+        }
+        if(pool->taken == pool->queued) {
+            break;
+        }
+        long number = pool->taken++;
+        struct job *job = &pool->jobs[number % WINDOW];
+        pthread_mutex_unlock(&pool->lock);
+
+        FILE *f;
+        if(scratch == NULL ||
+           (job->hash_val = calloc(pool->block_size, sizeof(char))) == NULL) {
+            job->error = ENOMEM;
+        }
+        else if((f = fopen(job->path, "rb")) == NULL) {
+            job->error = errno;
+        }
+        else {
+            errno = 0;
+            hash_stream_with(job->hash_val, pool->block_size, f, scratch);
+            if(ferror(f)) {
+                job->error = errno != 0 ? errno : EIO;
+            }
+            fclose(f);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        if(number == pool->printed) {
+            pthread_cond_signal(&pool->has_result);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(scratch);
+    return NULL;
+}
+
+// Prints the result of job, returning 1 if it counts as a failure.
+static int print_job(struct job *job, long block_size) {
+    if(job->error != 0) {
+        fprintf(stderr, "compute_hash: %s: %s\n", job->path,
+                strerror(job->error));
+        if(job->expected != NULL) {
+            printf("%s: FAILED open or read\n", job->path);
+        }
+        return 1;
+    }
+
+    if(job->expected == NULL) {
+        for(long i = 0; i < block_size; i++) {
+            printf("%.2hhx", job->hash_val[i]);
+        }
+        printf("  %s\n", job->path);
+        return 0;
+    }
+
+    if(strlen(job->expected) > block_size * 2) {
+        printf("%s: FAILED (comparison hash is larger than the block size)\n",
+               job->path);
+        return 1;
+    }
+    char *hash_comp = malloc(block_size);
+    if(hash_comp == NULL) {
+        job->error = ENOMEM;
+        return print_job(job, block_size);
+    }
+    xstr_to_hash(hash_comp, job->expected, block_size);
+    int comp = check_hash(job->hash_val, hash_comp, block_size);
+    free(hash_comp);
+    if(comp == block_size) {
+        printf("%s: OK\n", job->path);
+        return 0;
+    }
+    printf("%s: FAILED (first difference at index %d)\n", job->path, comp);
+    return 1;
+}
+
+/* Hashes everything the producer queues on a pool of threads and prints
+ * the results in order. Returns the number of files that couldn't be
+ * hashed or didn't match the manifest.
+ */
+static int run_pool(struct producer *producer, long block_size) {
+    struct pool *pool = calloc(1, sizeof(struct pool));
+    pthread_t producer_tid, tids[MAX_THREADS];
+    if(pool == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_room, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pthread_cond_init(&pool->has_result, NULL);
+    pool->block_size = block_size;
+    producer->pool = pool;
+
+    // Use two threads per core so that reads of one file overlap with
+    // hashing of another.
+    long nthreads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    if(nthreads < 1) {
+        nthreads = 1;
+    }
+    if(nthreads > MAX_THREADS) {
+        nthreads = MAX_THREADS;
+    }
+
+    int started = 0;
+    while(started < nthreads &&
+          pthread_create(&tids[started], NULL, worker_main, pool) == 0) {
+        started++;
+    }
+    if(started == 0 ||
+       pthread_create(&producer_tid, NULL, producer_main, producer) != 0) {
+        perror("pthread_create");
+        pthread_mutex_lock(&pool->lock);
+        pool->finished = 1;
+        pthread_cond_broadcast(&pool->has_work);
+        pthread_mutex_unlock(&pool->lock);
+        for(int i = 0; i < started; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        free(pool);
+        return 1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        while((pool->printed == pool->queued && !pool->finished) ||
+              (pool->printed < pool->queued &&
+               !pool->jobs[pool->printed % WINDOW].done)) {
+            pthread_cond_wait(&pool->has_result, &pool->lock);
+        }
+        if(pool->printed == pool->queued) {
+            break;
+        }
+        struct job *job = &pool->jobs[pool->printed % WINDOW];
+        pthread_mutex_unlock(&pool->lock);
+
+        int failed = print_job(job, block_size);
+        free(job->path);
+        free(job->expected);
+        free(job->hash_val);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->failures += failed;
+        pool->printed++;
+        pthread_cond_signal(&pool->has_room);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_join(producer_tid, NULL);
+    for(int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    int failures = pool->failures;
+    free(pool);
+    return failures;
+}
+
+
+/* Prints the hash of every regular file in the trees rooted at paths, one
+ * per line, in the same format that check_manifest reads.
+ * Returns the number of files that couldn't be hashed.
+ */
+int hash_files(long block_size, char **paths, int npaths) {
+    struct producer producer = {NULL, paths, npaths, NULL};
+    return run_pool(&producer, block_size);
+}
+
+/* Hashes every file listed in the manifest at path and reports whether
+ * its hash matches the one listed.
+ * Returns the number of files that didn't match or couldn't be hashed.
+ */
+int check_manifest(long block_size, const char *path) {
+    FILE *manifest = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if(manifest == NULL) {
+        perror(path);
+        return 1;
+    }
+    struct producer producer = {NULL, NULL, 0, manifest};
+    int failures = run_pool(&producer, block_size);
+    if(manifest != stdin) {
+        fclose(manifest);
+    }
+    return failures;
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "ftree.h"
+#include "arena.h"
+
+// Size of the chunks a FTree's nodes, names and hashes are carved out of.
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/*
+ * A chunk of memory that part of a FTree is allocated from.
+ */
+struct arena_chunk {
+    struct arena_chunk *next;    // Chunk allocated before this one.
+};
+
+struct ftree_arena {
+    struct arena_chunk *chunks;  // Most recently allocated chunk first.
+    char *free;                  // Next free byte of the current chunk.
+    char *end;                   // End of the current chunk.
+};
+
+/*
+ * Start of the first chunk of a FTree.
+ */
+struct arena_head {
+    struct arena_chunk chunk;
+    struct ftree_arena arena;
+    struct TreeNode root;
+};
+
+
+/*
+ * Starts a new FTree. Returns the (uninitialized) node for its root, and
+ * points arena at the arena the rest of the tree is to be allocated from,
+ * or returns NULL if there isn't enough memory.
+ */
+struct TreeNode *arena_new_tree(struct ftree_arena **arena) {
+    struct arena_head *head = malloc(ARENA_CHUNK_SIZE);
+    if(head == NULL) {
+        return NULL;
+    }
+    head->chunk.next = NULL;
+    head->arena.chunks = &head->chunk;
+    head->arena.free = (char *)(head + 1);
+    head->arena.end = (char *)head + ARENA_CHUNK_SIZE;
+    *arena = &head->arena;
+    return &head->root;
+}
+
+/*
+ * Returns a new arena that isn't attached to any tree, or NULL if there
+ * isn't enough memory. Its memory goes away with arena_destroy, or with
+ * the tree it's merged into by arena_merge.
+ */
+struct ftree_arena *arena_new(void) {
+    struct ftree_arena *arena = malloc(sizeof(struct ftree_arena));
+    if(arena != NULL) {
+        arena->chunks = NULL;
+        arena->free = NULL;
+        arena->end = NULL;
+    }
+    return arena;
+}
+
+/*
+ * Hands all the memory allocated from the arena 'from' (which must have come
+ * from arena_new) over to the arena 'into', so that it's freed along with
+ * into's tree. Destroys from.
+ */
+void arena_merge(struct ftree_arena *into, struct ftree_arena *from) {
+    if(from->chunks != NULL) {
+        struct arena_chunk *last = from->chunks;
+        while(last->next != NULL) {
+            last = last->next;
+        }
+        // Keep into's current chunk at the head, where it's still being
+        // allocated from.
+        last->next = into->chunks->next;
+        into->chunks->next = from->chunks;
+    }
+    free(from);
+}
+
+/*
+ * Frees an arena returned by arena_new along with everything allocated
+ * from it.
+ */
+void arena_destroy(struct ftree_arena *arena) {
+    struct arena_chunk *chunk = arena->chunks;
+    while(chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+}
+
+/*
+ * Returns size bytes from arena, aligned to align (a power of 2).
+ * Exits if there isn't enough memory.
+ */
+void *arena_alloc(struct ftree_arena *arena, size_t size, size_t align) {
+    char *p = (char *)(((uintptr_t)arena->free + align - 1) & ~(align - 1));
+    if(p + size > arena->end) {
+        // Start a new chunk, bigger than usual if size wouldn't fit.
+        size_t header = (sizeof(struct arena_chunk) + align - 1) &
+                        ~(align - 1);
+        size_t chunk_size = ARENA_CHUNK_SIZE;
+        if(header + size > chunk_size) {
+            chunk_size = header + size;
+        }
+        struct arena_chunk *chunk = malloc(chunk_size);
+        if(chunk == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        p = (char *)chunk + header;
+        arena->end = (char *)chunk + chunk_size;
+    }
+    arena->free = p + size;
+    return p;
+}
+
+/*
+ * Copies the len characters at str into arena as a string.
+ */
+char *arena_strndup(struct ftree_arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1, 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/*
+ * Returns an uninitialized TreeNode from arena.
+ */
+struct TreeNode *arena_new_node(struct ftree_arena *arena) {
+    return arena_alloc(arena, sizeof(struct TreeNode), sizeof(void *));
+}
+
+/*
+ * Frees the arena of the FTree rooted at root, which must have been
+ * returned by arena_new_tree, along with everything allocated from it.
+ */
+void arena_free_tree(struct TreeNode *root) {
+    struct arena_head *head = (struct arena_head *)((char *)root -
+                              offsetof(struct arena_head, root));
+    struct arena_chunk *chunk = head->arena.chunks;
+    while(chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
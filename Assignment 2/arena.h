@@ -0,0 +1,36 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "ftree.h"
+
+/*
+ * Memory a FTree is allocated from. Nodes, names and hashes are bumped off
+ * big chunks, so building a tree costs one malloc per chunk instead of
+ * several per file, and the whole tree is released by freeing the chunks.
+ * The arena lives right in front of the root of its tree, so the root is
+ * all that's needed to free it. An arena must only be used by one thread
+ * at a time.
+ */
+struct ftree_arena;
+
+// Arena helper functions in arena.c
+struct TreeNode *arena_new_tree(struct ftree_arena **arena);
+struct ftree_arena *arena_new(void);
+void arena_merge(struct ftree_arena *into, struct ftree_arena *from);
+void arena_destroy(struct ftree_arena *arena);
+void *arena_alloc(struct ftree_arena *arena, size_t size, size_t align);
+char *arena_strndup(struct ftree_arena *arena, const char *str, size_t len);
+struct TreeNode *arena_new_node(struct ftree_arena *arena);
+void arena_free_tree(struct TreeNode *root);
+
+// Node helpers shared by the FTree generators in ftree.c
+struct stat;
+void set_node_status(struct TreeNode *node, const struct stat *info,
+                     mode_t type);
+char *alloc_node_path(struct ftree_arena *arena, const char *dir,
+                      const char *name);
+void digest_dir(struct ftree_arena *arena, struct TreeNode *node);
+
+#endif // _ARENA_H_
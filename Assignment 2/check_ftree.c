@@ -0,0 +1,365 @@
+/*
+ * Checks that print_ftree -d reports how a tree changed since it was
+ * saved with -o, with and without -m, on one thread and on several.
+ *
+ * "make check" builds print_ftree and this, and runs this from the
+ * directory print_ftree is in. Each case builds a small fixture tree in a
+ * temporary directory, saves it, changes it and compares what -d prints
+ * with what the case expects. Snapshots damaged in various ways must be
+ * rejected by -i and -d rather than read, and missing paths and bad -j
+ * values must be errors. A line is printed for each run that fails, and
+ * the exit status is 1 if any did.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Most output of print_ftree kept per run.
+#define OUTPUT_MAX 4096
+
+// Offsets of fields of a snapshot's header and of its nodes, and the size
+// of a node (see snapshot.c and struct FlatNode).
+#define SNAP_COUNT 16
+#define SNAP_NAMES_LEN 32
+#define SNAP_NODES_OFFSET 40
+#define SNAP_NAMES_OFFSET 48
+#define NODE_SIZE 40
+#define NODE_NAME 0
+#define NODE_END 4
+#define NODE_HASH 8
+#define NODE_TYPE 16
+
+/*
+ * A change to the fixture, and what print_ftree -d should print after it.
+ */
+struct check_case {
+    const char *name;
+    void (*change)(void);        // Run from the directory holding t.
+    const char *expected;
+};
+
+static char print_ftree[4096];
+
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+/*
+ * Writes len bytes of data to the file at path, opened with mode ("w" to
+ * replace it or "a" to append to it).
+ */
+static void write_file(const char *path, const char *mode, const char *data,
+                       size_t len) {
+    FILE *f = fopen(path, mode);
+    if(f == NULL || fwrite(data, 1, len, f) != len || fclose(f) != 0) {
+        die(path);
+    }
+}
+
+static void make_dir(const char *path) {
+    if(mkdir(path, 0755) != 0) {
+        die(path);
+    }
+}
+
+/*
+ * Makes the fixture tree t in the current directory:
+ *     t/x/{a,b,c,d,e}   "12345678" each
+ *     t/y/z             "hi\n"
+ *     t/y/w/deep        "deep\n"
+ */
+static void make_fixture(void) {
+    if(system("rm -rf t snap") != 0) {
+        die("rm");
+    }
+    make_dir("t");
+    make_dir("t/x");
+    make_dir("t/y");
+    make_dir("t/y/w");
+    const char *names[] = {"t/x/a", "t/x/b", "t/x/c", "t/x/d", "t/x/e"};
+    for(int i = 0; i < 5; i++) {
+        write_file(names[i], "w", "12345678", 8);
+    }
+    write_file("t/y/z", "w", "hi\n", 3);
+    write_file("t/y/w/deep", "w", "deep\n", 5);
+}
+
+/*
+ * Runs print_ftree with args, keeping what it prints to stdout in out.
+ * Returns its exit status, or -1 if it couldn't be run.
+ */
+static int run(const char *args, char *out) {
+    char cmd[8192];
+    snprintf(cmd, sizeof(cmd), "'%s' %s 2>/dev/null", print_ftree, args);
+    FILE *p = popen(cmd, "r");
+    if(p == NULL) {
+        return -1;
+    }
+    size_t len = fread(out, 1, OUTPUT_MAX - 1, p);
+    out[len] = '\0';
+    return pclose(p);
+}
+
+
+static void unchanged(void) {
+}
+
+static void change_contents(void) {
+    write_file("t/x/c", "w", "87654321", 8);
+}
+
+static void change_size(void) {
+    write_file("t/y/z", "a", "there\n", 6);
+}
+
+static void change_permissions(void) {
+    if(chmod("t/x/b", 0600) != 0) {
+        die("chmod");
+    }
+}
+
+static void add_files(void) {
+    write_file("t/n", "w", "new\n", 4);
+    make_dir("t/y/v");
+    write_file("t/y/v/f", "w", "f\n", 2);
+}
+
+static void remove_files(void) {
+    if(unlink("t/x/d") != 0 || system("rm -rf t/y/w") != 0) {
+        die("remove");
+    }
+}
+
+static void change_type(void) {
+    if(unlink("t/y/z") != 0) {
+        die("unlink");
+    }
+    make_dir("t/y/z");
+}
+
+static void change_deep_file(void) {
+    write_file("t/y/w/deep", "w", "DEEP\n", 5);
+}
+
+/*
+ * Equal changes at the same offset of two files of a directory, which
+ * would cancel out if directory digests were a linear fold of their
+ * children.
+ */
+static void change_two_files(void) {
+    write_file("t/x/a", "a", "ABCDEFGH", 8);
+    write_file("t/x/e", "a", "ABCDEFGH", 8);
+}
+
+/*
+ * Zeros don't change the hash of a file, so only its size shows this.
+ */
+static void append_zeros(void) {
+    char zeros[64] = {0};
+    write_file("t/x/b", "a", zeros, sizeof(zeros));
+}
+
+/*
+ * Reads len (4 or 8) bytes of the file open on fd at offset as a number.
+ */
+static uint64_t read_number(int fd, off_t offset, size_t len) {
+    uint32_t n32;
+    uint64_t n64;
+    if(pread(fd, len == 4 ? (void *)&n32 : (void *)&n64, len, offset) !=
+       (ssize_t)len) {
+        die("pread");
+    }
+    return len == 4 ? n32 : n64;
+}
+
+static void write_number(int fd, off_t offset, uint32_t n) {
+    if(pwrite(fd, &n, sizeof(n), offset) != sizeof(n)) {
+        die("pwrite");
+    }
+}
+
+/*
+ * Damages the snapshot open on fd in the way numbered which, and returns
+ * what the damage is, or NULL if there's no such way.
+ */
+static const char *damage_snapshot(int fd, int which) {
+    uint32_t count = read_number(fd, SNAP_COUNT, 4);
+    off_t nodes = read_number(fd, SNAP_NODES_OFFSET, 8);
+    off_t names = read_number(fd, SNAP_NAMES_OFFSET, 8);
+    off_t names_len = read_number(fd, SNAP_NAMES_LEN, 8);
+    switch(which) {
+    case 0:
+        write_number(fd, nodes + NODE_SIZE + NODE_NAME, 0x7fffffff);
+        return "name past the string pool";
+    case 1:
+        write_number(fd, nodes + NODE_SIZE + NODE_END, 1);
+        return "subtree ending at its own node";
+    case 2:
+        write_number(fd, nodes + NODE_END, count + 5);
+        return "subtree ending past the table";
+    case 3:
+        // Stretch the first child of the first directory with children
+        // that isn't last out to the end of the table.
+        for(uint32_t i = 1; i < count; i++) {
+            uint32_t end = read_number(fd, nodes + i * NODE_SIZE + NODE_END,
+                                       4);
+            if(end > i + 1 && end < count) {
+                write_number(fd, nodes + (i + 1) * NODE_SIZE + NODE_END,
+                             count);
+                break;
+            }
+        }
+        return "subtree ending past its parent's";
+    case 4:
+        write_number(fd, nodes + NODE_SIZE + NODE_HASH, 0x7ffffff0);
+        return "hash past the hash table";
+    case 5:
+        if(pwrite(fd, "x", 1, names + names_len - 1) != 1) {
+            die("pwrite");
+        }
+        return "unterminated string pool";
+    case 6:
+        for(uint32_t i = 0; i < count; i++) {
+            if(S_ISREG(read_number(fd, nodes + i * NODE_SIZE + NODE_TYPE,
+                                   4))) {
+                write_number(fd, nodes + i * NODE_SIZE + NODE_HASH,
+                             0xffffffff);
+                break;
+            }
+        }
+        return "regular file without a hash";
+    }
+    return NULL;
+}
+
+/*
+ * Checks that print_ftree rejects each kind of damaged snapshot with an
+ * error instead of reading it (or crashing). Counts runs and failures.
+ */
+static void check_damaged_snapshots(int *runs, int *failures) {
+    char out[OUTPUT_MAX];
+    for(int which = 0; ; which++) {
+        make_fixture();
+        if(run("-j 1 -o snap t >/dev/null", out) != 0) {
+            die("print_ftree -o");
+        }
+        int fd = open("snap", O_RDWR);
+        if(fd == -1) {
+            die("snap");
+        }
+        const char *damage = damage_snapshot(fd, which);
+        close(fd);
+        if(damage == NULL) {
+            break;
+        }
+        const char *args[] = {"-i snap", "-d snap t"};
+        for(int i = 0; i < 2; i++) {
+            int ret = run(args[i], out);
+            (*runs)++;
+            if(!WIFEXITED(ret) || WEXITSTATUS(ret) != 1) {
+                (*failures)++;
+                printf("FAIL %s accepted by %s\n", damage, args[i]);
+            }
+        }
+    }
+}
+
+/*
+ * Checks that print_ftree fails with status 1, instead of crashing or
+ * going on, when given a path that doesn't exist or a bad -j. Counts runs
+ * and failures.
+ */
+static void check_bad_args(int *runs, int *failures) {
+    const char *args[] = {
+        "missing", "-j 4 missing", "-o snap missing", "-m -j 4 missing",
+        "-m -o snap missing", "-j foo t", "-j -2 t", "-j 4x t",
+    };
+    char out[OUTPUT_MAX];
+    make_fixture();
+    for(size_t i = 0; i < sizeof(args) / sizeof(args[0]); i++) {
+        int ret = run(args[i], out);
+        (*runs)++;
+        if(!WIFEXITED(ret) || WEXITSTATUS(ret) != 1) {
+            (*failures)++;
+            printf("FAIL print_ftree %s didn't exit with 1\n", args[i]);
+        }
+    }
+}
+
+static const struct check_case cases[] = {
+    {"unchanged", unchanged, ""},
+    {"contents", change_contents, "modified: x/c (hash)\n"},
+    {"size", change_size, "modified: y/z (size)\n"},
+    {"permissions", change_permissions, "modified: x/b (permissions)\n"},
+    {"added", add_files, "added: n\nadded: y/v\n"},
+    {"removed", remove_files, "removed: x/d\nremoved: y/w\n"},
+    {"type", change_type, "type changed: y/z\n"},
+    {"deep", change_deep_file, "modified: y/w/deep (hash)\n"},
+    {"two files", change_two_files,
+     "modified: x/a (size)\nmodified: x/e (size)\n"},
+    {"zeros", append_zeros, "modified: x/b (size)\n"},
+};
+
+
+int main(int argc, char **argv) {
+    if(realpath("print_ftree", print_ftree) == NULL) {
+        die("print_ftree");
+    }
+    char dir[] = "/tmp/check_ftree.XXXXXX";
+    if(mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        die("mkdtemp");
+    }
+
+    // Each case is run without and with -m, on one thread and on four.
+    const char *modes[] = {"", "-m "};
+    const int threads[] = {1, 4};
+    int runs = 0, failures = 0;
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        for(int m = 0; m < 2; m++) {
+            for(int t = 0; t < 2; t++) {
+                char args[256], out[OUTPUT_MAX];
+                make_fixture();
+                snprintf(args, sizeof(args), "%s-j %d -o snap t >/dev/null",
+                         modes[m], threads[t]);
+                int ret = run(args, out);
+                cases[i].change();
+                snprintf(args, sizeof(args), "%s-j %d -d snap t", modes[m],
+                         threads[t]);
+                if(ret == 0) {
+                    ret = run(args, out);
+                }
+                runs++;
+                if(ret != 0 || strcmp(out, cases[i].expected) != 0) {
+                    failures++;
+                    printf("FAIL %s (%s-j %d)\nexpected:\n%sgot:\n%s",
+                           cases[i].name, modes[m], threads[t],
+                           cases[i].expected, ret != 0 ? "(failed)\n" : out);
+                }
+            }
+        }
+    }
+
+    check_damaged_snapshots(&runs, &failures);
+    check_bad_args(&runs, &failures);
+
+    if(chdir("/") != 0) {
+        die("chdir");
+    }
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+    if(system(cmd) != 0) {
+        perror("rm");
+    }
+    printf("%d of %d checks passed\n", runs - failures, runs);
+    return failures > 0;
+}
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ftree.h"
+#include "hash.h"
+#include "arena.h"
+
+/*
+ * Running totals of the sizes of the arrays of a flat FTree.
+ */
+struct flat_size {
+    size_t count;
+    size_t names_len;
+    size_t nhashes;
+};
+
+
+/*
+ * Returns 1 if a node of the given type is a file, which has a hash.
+ */
+static int is_file(unsigned int type) {
+    return S_ISREG(type) || S_ISLNK(type);
+}
+
+/*
+ * Returns 1 if node has a hash, or a digest for the hash array.
+ */
+static int has_hash(const struct TreeNode *node) {
+    return is_file(node->type) || node->digest != NULL;
+}
+
+/*
+ * Adds the sizes needed for the subtree rooted at node to size.
+ */
+static void measure_node(struct TreeNode *node, struct flat_size *size) {
+    size->count++;
+    size->names_len += strlen(node->fname) + 1;
+    if(has_hash(node)) {
+        size->nhashes++;
+    }
+    for(struct TreeNode *child = node->contents; child != NULL;
+        child = child->next) {
+        measure_node(child, size);
+    }
+}
+
+/*
+ * Copies the subtree rooted at node into tree, starting at node index
+ * size->count, and advances the totals in size past it.
+ */
+static void flatten_node(struct TreeNode *node, struct FlatTree *tree,
+                         struct flat_size *size) {
+    struct FlatNode *flat = &tree->nodes[size->count++];
+    size_t len = strlen(node->fname) + 1;
+
+    memcpy(tree->names + size->names_len, node->fname, len);
+    flat->name = size->names_len;
+    size->names_len += len;
+    flat->permissions = node->permissions;
+    flat->type = node->type;
+    flat->unused = 0;
+    flat->size = node->size;
+    flat->mtime = node->mtime;
+    flat->hash = FLAT_DIR;
+    if(has_hash(node)) {
+        memcpy(tree->hashes + size->nhashes * BLOCK_SIZE, ftree_digest(node),
+               BLOCK_SIZE);
+        flat->hash = size->nhashes++;
+    }
+    for(struct TreeNode *child = node->contents; child != NULL;
+        child = child->next) {
+        flatten_node(child, tree, size);
+    }
+    flat->end = size->count;
+}
+
+/*
+ * Returns a flat FTree with the same contents as the FTree rooted at root,
+ * in dynamically allocated memory that's freed by free_flat_ftree. Files
+ * of a lazily hashed FTree are hashed now. Returns
+ * NULL (with errno set) if there isn't enough memory, or if the tree is
+ * too big to be indexed by 32 bit numbers.
+ */
+struct FlatTree *flatten_ftree(struct TreeNode *root) {
+    struct flat_size size = {0, 0, 0};
+    if(root != NULL) {
+        measure_node(root, &size);
+    }
+    if(size.count >= FLAT_DIR || size.names_len > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return NULL;
+    }
+
+    struct FlatTree *tree = malloc(sizeof(struct FlatTree));
+    if(tree == NULL) {
+        return NULL;
+    }
+    tree->count = size.count;
+    tree->names_len = size.names_len;
+    tree->nhashes = size.nhashes;
+    tree->hash_size = BLOCK_SIZE;
+    tree->map = NULL;
+    tree->map_size = 0;
+    tree->nodes = malloc(size.count * sizeof(struct FlatNode) + 1);
+    tree->names = malloc(size.names_len + 1);
+    tree->hashes = malloc(size.nhashes * BLOCK_SIZE + 1);
+    if(tree->nodes == NULL || tree->names == NULL || tree->hashes == NULL) {
+        free_flat_ftree(tree);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if(root != NULL) {
+        size.count = size.names_len = size.nhashes = 0;
+        flatten_node(root, tree, &size);
+    }
+    return tree;
+}
+
+/*
+ * Fills in node with the contents of the subtree of tree rooted at index.
+ */
+static void unflatten_node(const struct FlatTree *tree, uint32_t index,
+                           struct TreeNode *node, struct ftree_arena *arena) {
+    const struct FlatNode *flat = &tree->nodes[index];
+    const char *name = tree->names + flat->name;
+
+    node->fname = arena_strndup(arena, name, strlen(name));
+    node->permissions = flat->permissions;
+    node->hash = NULL;
+    node->digest = NULL;
+    node->contents = NULL;
+    node->next = NULL;
+    set_node_status(node, NULL, flat->type);
+    node->size = flat->size;
+    node->mtime = flat->mtime;
+    if(flat->hash != FLAT_DIR) {
+        char *hash_val = arena_alloc(arena, BLOCK_SIZE, 1);
+        memcpy(hash_val, tree->hashes + (size_t)flat->hash * BLOCK_SIZE,
+               BLOCK_SIZE);
+        if(S_ISDIR(flat->type)) {
+            node->digest = hash_val;
+        }
+        else {
+            node->hash = hash_val;
+        }
+    }
+
+    struct TreeNode **tail = &node->contents;
+    for(uint32_t child = index + 1; child < flat->end;
+        child = tree->nodes[child].end) {
+        *tail = arena_new_node(arena);
+        unflatten_node(tree, child, *tail, arena);
+        tail = &(*tail)->next;
+    }
+}
+
+/*
+ * Returns a FTree with the same contents as the flat FTree tree, to be
+ * freed by free_ftree, or NULL if tree is empty or there isn't enough
+ * memory.
+ */
+struct TreeNode *unflatten_ftree(const struct FlatTree *tree) {
+    struct ftree_arena *arena;
+    if(tree->count == 0 || tree->hash_size != BLOCK_SIZE) {
+        return NULL;
+    }
+    struct TreeNode *root = arena_new_tree(&arena);
+    if(root != NULL) {
+        unflatten_node(tree, 0, root, arena);
+    }
+    return root;
+}
+
+/*
+ * Frees a flat FTree returned by flatten_ftree or ftree_load.
+ */
+void free_flat_ftree(struct FlatTree *tree) {
+    if(tree == NULL) {
+        return;
+    }
+    if(tree->map != NULL) {
+        munmap(tree->map, tree->map_size);
+    }
+    else {
+        free(tree->nodes);
+        free(tree->names);
+        free(tree->hashes);
+    }
+    free(tree);
+}
+
+
+/*
+ * Prints the nodes of a flat FTree the same way print_ftree prints the
+ * FTree it was made from. The nodes are already in preorder, so this is a
+ * single pass over the node array.
+ */
+void print_flat_ftree(const struct FlatTree *tree) {
+    // Ends of the directories enclosing the node being printed.
+    uint32_t *ends = NULL;
+    size_t depth = 0, cap = 0;
+
+    for(uint32_t i = 0; i < tree->count; i++) {
+        const struct FlatNode *node = &tree->nodes[i];
+        while(depth > 0 && ends[depth - 1] <= i) {
+            depth--;
+        }
+
+        printf("%*s", (int)depth * 2, "");
+        if(!is_file(node->type)) {
+            printf("===== %s (%o) =====\n", tree->names + node->name,
+                   node->permissions);
+        }
+        else {
+            printf("%s (%o)\n", tree->names + node->name, node->permissions);
+        }
+
+        if(node->end > i + 1) {
+            if(depth == cap) {
+                cap = cap == 0 ? 64 : cap * 2;
+                ends = realloc(ends, cap * sizeof(uint32_t));
+                if(ends == NULL) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            ends[depth++] = node->end;
+        }
+    }
+    free(ends);
+}
+
+/*
+ * Compares two flat FTrees node by node in preorder, skipping over
+ * directories whose digests match.
+ * Returns -1 if they have the same shape, names, permissions and hashes,
+ * and otherwise the index of the first node at which they differ.
+ */
+long compare_flat_ftrees(const struct FlatTree *a, const struct FlatTree *b) {
+    uint32_t count = a->count < b->count ? a->count : b->count;
+    if(a->hash_size != b->hash_size) {
+        return 0;
+    }
+    for(uint32_t i = 0; i < count; i++) {
+        const struct FlatNode *x = &a->nodes[i], *y = &b->nodes[i];
+        if(x->end != y->end || x->permissions != y->permissions ||
+           is_file(x->type) != is_file(y->type) ||
+           strcmp(a->names + x->name, b->names + y->name) != 0) {
+            return i;
+        }
+        if(x->hash == FLAT_DIR || y->hash == FLAT_DIR) {
+            continue;
+        }
+        int same = memcmp(a->hashes + (size_t)x->hash * a->hash_size,
+                          b->hashes + (size_t)y->hash * b->hash_size,
+                          a->hash_size) == 0;
+        if(!same && is_file(x->type)) {
+            return i;
+        }
+        // Equal digests mean equal subtrees, whose ends already match.
+        if(same && !is_file(x->type)) {
+            i = x->end - 1;
+        }
+    }
+    return a->count == b->count ? -1 : (long)count;
+}
@@ -1,160 +1,431 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 #include "ftree.h"
 #include "hash.h"
+#include "arena.h"
+#include "dir_reader.h"
+
+/*
+ * A directory whose contents are being added to the tree. The traversal
+ * keeps a stack of these on the heap rather than recursing, and works
+ * relative to the open directory, so every system call only resolves a
+ * single name whatever the depth.
+ */
+struct dir_frame {
+    struct dir_reader *dir;
+    struct TreeNode *node;
+    struct TreeNode **tail;      // Where the next child is linked in.
+    const char *path;            // Only kept with FTREE_LAZY_HASH.
+};
+
+/*
+ * State of one run of generate_ftree_ex.
+ */
+struct walker {
+    struct ftree_arena *arena;
+    int flags;
+    int use_cache;               // Regular files need a stat for the cache.
+    int lazy;                    // Files are hashed by ftree_hash.
+    struct dir_frame *stack;
+    size_t depth;
+    size_t cap;
+    struct TreeNode **children;  // Buffer for sorting a directory.
+    size_t children_cap;
+};
 
 void print_tree(struct TreeNode *node, int depth);
+
+
+static int compare_names(const void *a, const void *b) {
+    const struct TreeNode *x = *(struct TreeNode * const *)a;
+    const struct TreeNode *y = *(struct TreeNode * const *)b;
+    return strcmp(x->fname, y->fname);
+}
+
+/*
+ * Puts the files of the directory node in name order.
+ */
+static void sort_children(struct walker *walker, struct TreeNode *node) {
+    size_t n = 0;
+    for(struct TreeNode *child = node->contents; child != NULL;
+        child = child->next) {
+        if(n == walker->children_cap) {
+            walker->children_cap = n == 0 ? 256 : n * 2;
+            walker->children = realloc(walker->children,
+                    walker->children_cap * sizeof(struct TreeNode *));
+            if(walker->children == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        walker->children[n++] = child;
+    }
+    qsort(walker->children, n, sizeof(struct TreeNode *), compare_names);
+    struct TreeNode **tail = &node->contents;
+    for(size_t i = 0; i < n; i++) {
+        *tail = walker->children[i];
+        tail = &walker->children[i]->next;
+    }
+    *tail = NULL;
+}
+
+/*
+ * Starts reading the contents of the directory node at path, opened as
+ * name relative to dirfd. Returns -1 if it can't be opened.
+ */
+static int push_dir(struct walker *walker, int dirfd, const char *name,
+                    const char *path, struct TreeNode *node) {
+    struct dir_reader *dir = dir_open(dirfd, name);
+    if(dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+    if(walker->depth == walker->cap) {
+        walker->cap = walker->cap == 0 ? 64 : walker->cap * 2;
+        walker->stack = realloc(walker->stack,
+                                walker->cap * sizeof(struct dir_frame));
+        if(walker->stack == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct dir_frame *frame = &walker->stack[walker->depth++];
+    frame->dir = dir;
+    frame->node = node;
+    frame->tail = &node->contents;
+    frame->path = path;
+    return 0;
+}
+
+/*
+ * Fills in the type of node, and the size and modification time from its
+ * status info (if it was stat-ed).
+ */
+void set_node_status(struct TreeNode *node, const struct stat *info,
+                     mode_t type) {
+    node->type = type;
+    node->size = info == NULL ? 0 : info->st_size;
+    node->mtime = info == NULL ? 0 : info->st_mtim.tv_sec * 1000000000LL +
+                                     info->st_mtim.tv_nsec;
+    node->path = NULL;
+}
+
+/*
+ * Returns a copy of dir + "/" + name, or just name if dir is NULL,
+ * allocated from arena right after room for a hash, so that ftree_hash
+ * has somewhere to put the hash of a lazily hashed file.
+ */
+char *alloc_node_path(struct ftree_arena *arena, const char *dir,
+                      const char *name) {
+    size_t dirlen = dir == NULL ? 0 : strlen(dir) + 1;
+    size_t namelen = strlen(name);
+    char *path = (char *)arena_alloc(arena, BLOCK_SIZE + dirlen + namelen + 1,
+                                     1) + BLOCK_SIZE;
+    if(dir != NULL) {
+        memcpy(path, dir, dirlen - 1);
+        path[dirlen - 1] = '/';
+    }
+    memcpy(path + dirlen, name, namelen + 1);
+    return path;
+}
+
+/*
+ * Mixes the string s, and its length, into h.
+ */
+static uint64_t mix_string(uint64_t h, const char *s) {
+    size_t len = strlen(s);
+    for(size_t i = 0; i < len; i += sizeof(uint64_t)) {
+        uint64_t chunk = 0;
+        size_t part = len - i < sizeof(chunk) ? len - i : sizeof(chunk);
+        memcpy(&chunk, s + i, part);
+        h = hash_mix(h, chunk);
+    }
+    return hash_mix(h, len);
+}
+
+/*
+ * Sets the digest of the directory node, allocated from arena, by mixing
+ * the name, type, permissions and digest of each of its files in name
+ * order, along with the size and modification time of those that aren't
+ * directories (since file hashes alone miss changes like appended zeros).
+ * The records are mixed rather than folded like file contents, so that
+ * equal changes to two files can't cancel out. The digests of any
+ * directories in it must be set already.
+ */
+void digest_dir(struct ftree_arena *arena, struct TreeNode *node) {
+    size_t n = 0;
+    for(struct TreeNode *child = node->contents; child != NULL;
+        child = child->next) {
+        n++;
+    }
+    struct TreeNode **children = malloc((n + 1) * sizeof(struct TreeNode *));
+    if(children == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    n = 0;
+    for(struct TreeNode *child = node->contents; child != NULL;
+        child = child->next) {
+        children[n++] = child;
+    }
+    qsort(children, n, sizeof(struct TreeNode *), compare_names);
+
+    uint64_t h = 0;
+    for(size_t i = 0; i < n; i++) {
+        struct TreeNode *child = children[i];
+        const char *digest = ftree_digest(child);
+        uint64_t child_digest = 0;
+        if(digest != NULL) {
+            memcpy(&child_digest, digest, BLOCK_SIZE);
+        }
+        h = mix_string(h, child->fname);
+        h = hash_mix(h, (uint64_t)child->type | child->permissions);
+        if(!S_ISDIR(child->type)) {
+            h = hash_mix(h, child->size);
+            h = hash_mix(h, child->mtime);
+        }
+        h = hash_mix(h, child_digest);
+    }
+    h = hash_mix(h, n);
+    node->digest = arena_alloc(arena, BLOCK_SIZE, 1);
+    memcpy(node->digest, &h, BLOCK_SIZE);
+    free(children);
+}
+
+/*
+ * Fills in node for the file name in the directory open on dirfd, whose
+ * path is dir_path (only needed with FTREE_LAZY_HASH). info is its status,
+ * or NULL if it wasn't needed, in which case type is its type (as an S_IF*
+ * value) from the directory entry. Directories are pushed onto the stack
+ * to have their contents added.
+ */
+static void fill_node(struct walker *walker, struct TreeNode *node,
+                      int dirfd, const char *dir_path, const char *name,
+                      const struct stat *info, mode_t type) {
+    // Name the root after the last component of the path it was given.
+    const char *fname = strrchr(name, '/') == NULL ? name :
+                        strrchr(name, '/') + 1;
+    node->fname = arena_strndup(walker->arena, fname, strlen(fname));
+    // Get permissions for file by bitwise and st_mode and mask.
+    node->permissions = info == NULL ? 0 : info->st_mode & 0777;
+    node->contents = NULL;
+    node->hash = NULL;
+    node->digest = NULL;
+    node->next = NULL;
+    set_node_status(node, info, type);
+
+    // Only lazy trees need paths, to hash files from later.
+    const char *path = NULL;
+    if(walker->lazy && (S_ISDIR(type) || S_ISREG(type) || S_ISLNK(type))) {
+        path = alloc_node_path(walker->arena, dir_path, name);
+    }
+
+    // Check if file is a directory. One that can't be read is left
+    // empty, and gets the digest of an empty directory.
+    if(S_ISDIR(type)) {
+        if(push_dir(walker, dirfd, name, path, node) != 0 &&
+           (walker->flags & FTREE_MERKLE)) {
+            digest_dir(walker->arena, node);
+        }
+    }
+
+    // Leave a link or a regular file to be hashed by ftree_hash.
+    else if(walker->lazy && (S_ISREG(type) || S_ISLNK(type))) {
+        node->path = (char *)path;
+    }
+
+    // Check if file is a link or a regular file.
+    else if(S_ISREG(type) || S_ISLNK(type)) {
+        // Hash the contents of the file, reusing the cached hash of a
+        // regular file that hasn't changed. A link is always rehashed,
+        // since its own status says nothing about its target.
+        node->hash = arena_alloc(walker->arena, BLOCK_SIZE, 1);
+        if(hash_cached(node->hash, dirfd, name,
+                       S_ISREG(type) ? info : NULL) == NULL) {
+            // Use an empty hash if file can't be read.
+            perror("open");
+            memset(node->hash, '\0', BLOCK_SIZE);
+        }
+    }
+}
+
+/*
+ * Adds the next visible file of the directory on top of the stack to it,
+ * or pops the directory when there are no more.
+ */
+static void walk_step(struct walker *walker) {
+    struct dir_frame *frame = &walker->stack[walker->depth - 1];
+    struct dir_entry entry;
+    int ret;
+    while((ret = dir_next(frame->dir, &entry)) == 1 && entry.name[0] == '.') {
+    }
+    if(ret != 1) {
+        if(ret == -1) {
+            perror("readdir");
+        }
+        dir_close(frame->dir);
+        if(walker->flags & FTREE_SORTED) {
+            sort_children(walker, frame->node);
+        }
+        // The directories in it were all popped before it.
+        if(walker->flags & FTREE_MERKLE) {
+            digest_dir(walker->arena, frame->node);
+        }
+        walker->depth--;
+        return;
+    }
+
+    // Skip the stat when the directory entry gives the type and nothing
+    // else is needed: no permissions, and no cache key or (for lazy
+    // hashing) size and modification time for regular files.
+    struct stat info;
+    int fd = dir_fd(frame->dir);
+    mode_t type = entry.type;
+    int need_stat = !(walker->flags & FTREE_NO_PERMS) || type == 0 ||
+                    (S_ISREG(type) && (walker->use_cache || walker->lazy));
+    if(need_stat) {
+        if(fstatat(fd, entry.name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+            // Files that can't be lstat-ed are left out.
+            perror("lstat");
+            return;
+        }
+        type = info.st_mode & S_IFMT;
+    }
+
+    // fill_node may grow the stack, so link the child in first.
+    struct TreeNode *child = arena_new_node(walker->arena);
+    child->next = NULL;
+    *frame->tail = child;
+    frame->tail = &child->next;
+    fill_node(walker, child, fd, frame->path, entry.name,
+              need_stat ? &info : NULL, type);
+}
+
+
 /*
  * Returns the FTree rooted at the path fname.
  */
 struct TreeNode *generate_ftree(const char *fname) {
+    return generate_ftree_ex(fname, 0);
+}
 
-    // Allocate Memory for the node on the heap.
-    struct TreeNode *nodePointer = malloc(sizeof(struct TreeNode));
+/*
+ * Returns the FTree rooted at the path fname, built according to flags:
+ *     FTREE_SORTED   - The files of each directory are put in name order
+ *                      rather than the order the file system lists them.
+ *     FTREE_NO_PERMS - Permissions are left as 0, so files whose type the
+ *                      directory gives don't need to be stat-ed.
+ *     FTREE_URING    - The stats of each directory and the reads of many
+ *                      files at once are submitted through an io_uring,
+ *                      if the system has one, by the one thread of
+ *                      generate_ftree_parallel.
+ *     FTREE_LAZY_HASH - Files aren't read at all. Each file node keeps its
+ *                      path instead, and is hashed the first time its
+ *                      hash is asked for with ftree_hash.
+ *     FTREE_MERKLE   - Each directory gets a digest, set as soon as all
+ *                      of its contents have been added. The digests need
+ *                      every hash, so this overrides FTREE_LAZY_HASH.
+ */
+struct TreeNode *generate_ftree_ex(const char *fname, int flags) {
     struct stat info;
-    struct dirent *dp;
 
     if(fname == NULL) {
         return NULL;
     }
+    if(flags & FTREE_URING) {
+        return generate_ftree_parallel(fname, 1, flags);
+    }
+    if(flags & FTREE_MERKLE) {
+        flags &= ~FTREE_LAZY_HASH;
+    }
 
     if (lstat(fname, &info) != 0) {
         perror("lstat");
         return NULL;
     }
 
-    // Extract name of file from fname.
-    const char slash = '/';
-    char filename[1024] = {'\0'};
-    if(strrchr(fname, slash) == NULL) {
-        strncpy(filename, fname, 1023);
+    struct walker walker;
+    memset(&walker, 0, sizeof(walker));
+    walker.flags = flags;
+    walker.lazy = (flags & FTREE_LAZY_HASH) != 0;
+    walker.use_cache = !walker.lazy && hash_cache_enabled();
+    struct TreeNode *root = arena_new_tree(&walker.arena);
+    if(root == NULL) {
+        perror("malloc");
+        return NULL;
     }
-    else {
-        strncpy(filename, strrchr(fname, slash)+1, 1023);
+
+    fill_node(&walker, root, AT_FDCWD, NULL, fname, &info,
+              info.st_mode & S_IFMT);
+    if(flags & FTREE_NO_PERMS) {
+        root->permissions = 0;
+    }
+    while(walker.depth > 0) {
+        walk_step(&walker);
     }
-    int len = (strlen(filename));
 
+    free(walker.stack);
+    free(walker.children);
+    return root;
+}
 
-    nodePointer->fname = malloc(sizeof(char) * (len + 1));
-    strncpy(nodePointer->fname, filename, len);
-    (nodePointer->fname)[len] = '\0';
 
-    // Get permissions for file by bitwise and st_mode and mask.
-    int mask = 0777;
-    nodePointer->permissions = info.st_mode & mask;
-
-    // Initialize all pointers of the TreeNode to NULL.
-    nodePointer->contents = NULL;
-    nodePointer->hash = NULL;
-    nodePointer->next = NULL;
-    int pathlen = strlen(fname);
-    int namelen;
-
-    // Check if file is a directory.
-    if(S_ISDIR(info.st_mode)) {
-        DIR *dirp = opendir(fname);
-
-        // Return nodePointer if opendir fails.
-    	if(dirp == NULL) {
-    		perror("opendir");
-            errno = 0;
-    		return nodePointer;
-    	}
-
-        // Read through the directory until dp points to a valid file or
-        // if dp is NULL and there is no error from readdir.
-        dp = readdir(dirp);
-        while((dp != NULL || errno != 0) && (dp->d_name)[0] == '.') {
-            if(errno != 0) {
-                perror("readdir");
-                errno = 0;
-            }
-            dp = readdir(dirp);
-        }
-        if(dp != NULL) {
-            // Recursively call generate_ftree till nodePointer->contents
-            // has succesfully been assigned or dp reaches the end of dirp.
-            do {
-                namelen = strlen(dp->d_name);
-                int len = namelen + pathlen + 2; // Length of absolute path.
-                // Get absolute path of file d_name.
-                char *path = malloc(len * sizeof(char));
-                memset(path, '\0', len);
-                strncpy(path, fname, pathlen);
-                strncat(path, "/", 1);
-                strncat(path, dp->d_name, namelen);
-                nodePointer->contents = generate_ftree(path);
-                free(path);
-                // If nodePointer->contents was succesfully assigned NULL or
-                // a TreeNode, break out of the loop.
-                if(errno == 0) {
-                    break;
-                }
-                else {
-                    errno = 0;
-                    dp = readdir(dirp);
-                    if(errno != 0) {
-                        perror("readdir");
-                    }
-                }
-            } while(errno != 0 || dp != NULL);
-
-            // Generate linked list of TreeNodes that represent the files
-            // in the directory by recursively calling generate_ftree.
-            struct TreeNode *currNodePointer = nodePointer->contents;
-            dp = readdir(dirp);
-            while(dp != NULL || errno != 0) {
-                if(errno != 0) {
-                    perror("readir");
-                }
-                else if((dp->d_name)[0] != '.') {
-                    namelen = strlen(dp->d_name);
-                    int len = namelen + pathlen + 2; // Length of absolute path.
-                    // Get absolute path of file d_name.
-                    char *path = malloc(len * sizeof(char));
-                    memset(path, '\0', len);
-                    strncpy(path, fname, pathlen);
-                    strncat(path, "/", 1);
-                    strncat(path, dp->d_name, namelen);
-                    currNodePointer->next = generate_ftree(path);
-                    free(path);
-                    // Advance the pointer to the next node if
-                    // currNodePointer->next was set succesfully.
-                    if (errno == 0) {
-                        currNodePointer = currNodePointer->next;
-                    }
-                }
-                errno = 0;
-                dp = readdir(dirp);
-            }
-        }
-        closedir(dirp);
+/*
+ * Returns the hash of the file node, or NULL if it's a directory (or
+ * anything else that isn't a regular file or a link). In a FTree generated
+ * with FTREE_LAZY_HASH, the file is hashed the first time this is called
+ * on its node, from the path it was found at; a relative path is relative
+ * to the working directory the FTree was generated in. Files that can't be
+ * read get an empty hash. Two threads mustn't ask for the hash of the same
+ * node at once.
+ */
+char *ftree_hash(struct TreeNode *node) {
+    if(node->hash != NULL || node->path == NULL) {
+        return node->hash;
     }
 
-    // Check if file is a link or a regular file.
-    else if(S_ISREG(info.st_mode) || S_ISLNK(info.st_mode)) {
-        FILE *f = fopen(fname, "r");
-        // Assign an emtpy hash to nodePointer->hash if file can't be opened.
-        if(f == NULL) {
-            perror("fopen");
-            nodePointer->hash = malloc(sizeof(char)*(BLOCK_SIZE));
-            memset(nodePointer->hash, '\0', BLOCK_SIZE);
-            errno = 0;
-        }
-        // Hash the contents of the file.
-        else {
-            nodePointer->hash = hash(f);
-            fclose(f);
-        }
+    // The cache key is the file's status now, not when it was listed.
+    char *hash_val = node->path - BLOCK_SIZE;
+    struct stat info;
+    int cached = S_ISREG(node->type) && hash_cache_enabled() &&
+                 lstat(node->path, &info) == 0 && S_ISREG(info.st_mode);
+    if(hash_cached(hash_val, AT_FDCWD, node->path,
+                   cached ? &info : NULL) == NULL) {
+        perror("open");
+        memset(hash_val, '\0', BLOCK_SIZE);
+    }
+    node->hash = hash_val;
+    return hash_val;
+}
+
+/*
+ * Returns the hash of the file node, as ftree_hash does, or the digest of
+ * the directory node if it has one (in a FTree generated with FTREE_MERKLE
+ * or unflattened from one), or NULL.
+ */
+char *ftree_digest(struct TreeNode *node) {
+    if(S_ISDIR(node->type)) {
+        return node->digest;
     }
+    return ftree_hash(node);
+}
+
 
-    return nodePointer;
+/*
+ * Frees all the memory used by the FTree rooted at root, which must have
+ * been returned by generate_ftree.
+ */
+void free_ftree(struct TreeNode *root) {
+    if(root == NULL) {
+        return;
+    }
+    arena_free_tree(root);
 }
 
 
@@ -171,8 +442,9 @@ void print_ftree(struct TreeNode *root) {
  */
 void print_tree(struct TreeNode *node, int depth){
 
-    // Check if the node represents a directory.
-    if(node->hash == NULL) {
+    // Check if the node represents a directory (or anything else that has
+    // no hash).
+    if(!S_ISREG(node->type) && !S_ISLNK(node->type)) {
         printf("%*s", depth * 2, "");
         printf("===== %s (%o) =====\n", node->fname, node->permissions);
         struct TreeNode *currNodePointer = node->contents;
@@ -1,11 +1,20 @@
 #ifndef _FTREE_H_
 #define _FTREE_H_
 
+#include <stdint.h>
+#include <stddef.h>
+
 /*
  * Data structure for storing information about a single file.
  * For directories, contents is the linked list of files in the directory and hash is NULL.
  * For files, contents is NULL, and the hash is the hash of the file's contents.
  * next is the next file in the directory (or NULL).
+ * With FTREE_LAZY_HASH, the hash of a file stays NULL until it's asked for
+ * with ftree_hash, so type tells files and directories apart.
+ * With FTREE_MERKLE, digest is a hash over the names, modes and digests
+ * of a directory's files (and the sizes and modification times of those
+ * that aren't directories), so two directories with equal digests hold
+ * the same subtree.
  */
 struct TreeNode {
     char *fname;
@@ -15,19 +24,171 @@ struct TreeNode {
     char *hash;                  // For normal files and links
 
     struct TreeNode *next;
+
+    unsigned int type;           // S_IF* type of the file.
+    int64_t size;                // Size and modification time (in
+    int64_t mtime;               // nanoseconds), if the file was stat-ed.
+    char *path;                  // Where to hash the file from lazily.
+    char *digest;                // For directories, with FTREE_MERKLE.
 };
 
 
 /*
  * A FTree is a dynamically allocated tree structure that contains
  * information about the files in a file system. A FTree is represented by
- * a single TreeNode which is the root of the tree.
+ * a single TreeNode which is the root of the tree. All of its nodes, names
+ * and hashes are allocated together and can only be freed all at once, by
+ * passing the root to free_ftree.
  */
 
 // Function for generating a FTree given a root filename.
 struct TreeNode *generate_ftree(const char *fname);
+struct TreeNode *generate_ftree_ex(const char *fname, int flags);
+
+// Function for generating a FTree on several threads at once.
+struct TreeNode *generate_ftree_parallel(const char *fname, int threads,
+                                         int flags);
+
+// Flags for generate_ftree_ex and generate_ftree_parallel.
+#define FTREE_SORTED 0x1         // Put the files of directories in name order.
+#define FTREE_NO_PERMS 0x2       // Leave permissions 0, saving most stats.
+#define FTREE_URING 0x4          // Batch stats and reads with io_uring.
+#define FTREE_LAZY_HASH 0x8      // Only hash files when ftree_hash asks.
+#define FTREE_MERKLE 0x10        // Give directories digests.
+
+// Function for getting the hash of a file, hashing it first if need be.
+char *ftree_hash(struct TreeNode *node);
+
+// Function for getting the hash of a file or the digest of a directory.
+char *ftree_digest(struct TreeNode *node);
+
+// Function for freeing a FTree returned by generate_ftree.
+void free_ftree(struct TreeNode *root);
 
 // Function for printing the TreeNodes encountered on a preorder traversal of a FTree.
 void print_ftree(struct TreeNode *root);
 
+
+/*
+ * Record of a single file in a flat FTree. The subtree rooted at a node is
+ * the run of nodes from it up to (but not including) end, so its first
+ * child (if any) is the node right after it and the next sibling of any
+ * child is that child's end.
+ */
+struct FlatNode {
+    uint32_t name;               // Offset of the name in the string pool.
+    uint32_t end;                // Index just past the node's subtree.
+    uint32_t hash;               // Index of its hash or digest, or FLAT_DIR.
+    uint32_t permissions;
+    uint32_t type;               // As in TreeNode.
+    uint32_t unused;
+    int64_t size;
+    int64_t mtime;
+};
+
+// FlatNode hash of a directory without a digest (or of anything else
+// without a hash).
+#define FLAT_DIR UINT32_MAX
+
+/*
+ * A flat FTree holds the same information as a FTree in three arrays: the
+ * nodes in preorder, the names (each terminated by a '\0') in one string
+ * pool and the hashes of the files (and digests of the directories that
+ * have them) packed one after another. It refers to nodes, names and
+ * hashes by index rather than by pointer, so it can be walked without
+ * chasing pointers and stored or mapped as is.
+ */
+struct FlatTree {
+    struct FlatNode *nodes;
+    uint32_t count;              // Number of nodes.
+    char *names;
+    size_t names_len;            // Total length of the string pool.
+    char *hashes;                // Block of hash_size bytes per file.
+    uint32_t nhashes;
+    uint32_t hash_size;
+    void *map;                   // The snapshot it was loaded from, or NULL.
+    size_t map_size;
+};
+
+// Functions for converting between FTrees and flat FTrees.
+struct FlatTree *flatten_ftree(struct TreeNode *root);
+struct TreeNode *unflatten_ftree(const struct FlatTree *tree);
+void free_flat_ftree(struct FlatTree *tree);
+
+// Functions for printing and comparing flat FTrees.
+void print_flat_ftree(const struct FlatTree *tree);
+long compare_flat_ftrees(const struct FlatTree *a, const struct FlatTree *b);
+
+// Functions for saving flat FTrees to snapshot files and mapping them back.
+int ftree_save(const struct FlatTree *tree, const char *path);
+struct FlatTree *ftree_load(const char *path);
+
+
+/*
+ * A difference between two FTrees found by ftree_diff. path is the path
+ * of the file relative to the roots of the trees ("." for the roots
+ * themselves), and a and b are its nodes in each tree (NULL in the tree
+ * it isn't in). A directory that was added or removed is reported once,
+ * and not each file in it.
+ */
+struct ftree_change {
+    int kind;                    // One of the FTREE_* kinds below.
+    int what;                    // For FTREE_MODIFIED, FTREE_DIFF_* bits.
+    const char *path;
+    struct TreeNode *a;
+    struct TreeNode *b;
+};
+
+// Kinds of change.
+#define FTREE_ADDED 1            // Only in b.
+#define FTREE_REMOVED 2          // Only in a.
+#define FTREE_MODIFIED 3         // Same type, different contents.
+#define FTREE_TYPE_CHANGED 4     // E.g. a file in a, a directory in b.
+
+// What differs in a modified file.
+#define FTREE_DIFF_SIZE 0x1
+#define FTREE_DIFF_PERMS 0x2
+#define FTREE_DIFF_HASH 0x4
+
+typedef void (*ftree_diff_callback)(const struct ftree_change *change,
+                                    void *arg);
+
+// Function for finding the differences between two FTrees.
+long ftree_diff(struct TreeNode *a, struct TreeNode *b,
+                ftree_diff_callback callback, void *arg);
+
+
+/*
+ * A file found by walk_ftree. fname and path (the path it was found at,
+ * starting with the path walk_ftree was given) are only valid during the
+ * callback. depth is 0 for the root. size and mtime are 0 if the file
+ * wasn't stat-ed.
+ */
+struct ftree_entry {
+    const char *fname;
+    const char *path;
+    int permissions;
+    unsigned int type;           // S_IF* type of the file.
+    int64_t size;
+    int64_t mtime;
+    int depth;
+};
+
+/*
+ * Callbacks made by walk_ftree, in the order print_ftree prints files.
+ * enter_dir is called on a directory before any of its contents, and
+ * returns nonzero to have them visited; leave_dir is called after them
+ * (or right away if they're skipped). file is called on anything else.
+ * Any of them may be NULL.
+ */
+struct ftree_visitor {
+    int (*enter_dir)(const struct ftree_entry *entry, void *arg);
+    void (*file)(const struct ftree_entry *entry, void *arg);
+    void (*leave_dir)(const struct ftree_entry *entry, void *arg);
+};
+
+// Function for visiting the files of a FTree without building it.
+int walk_ftree(const char *fname, int flags,
+               const struct ftree_visitor *visitor, void *arg);
+
 #endif // _FTREE_H_
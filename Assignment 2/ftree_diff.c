@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ftree.h"
+#include "hash.h"
+
+/*
+ * State of one run of ftree_diff.
+ */
+struct differ {
+    ftree_diff_callback callback;
+    void *arg;
+    long changes;
+    char *path;                  // Path of the pair of nodes being compared.
+    size_t path_len;
+    size_t path_cap;
+};
+
+
+static int compare_names(const void *x, const void *y) {
+    const struct TreeNode *a = *(struct TreeNode * const *)x;
+    const struct TreeNode *b = *(struct TreeNode * const *)y;
+    return strcmp(a->fname, b->fname);
+}
+
+/*
+ * Returns the files of the directory node in name order, in an array of
+ * *count pointers that the caller frees.
+ */
+static struct TreeNode **sorted_children(struct TreeNode *node,
+                                         size_t *count) {
+    size_t n = 0;
+    for(struct TreeNode *child = node->contents; child != NULL;
+        child = child->next) {
+        n++;
+    }
+    struct TreeNode **children = malloc((n + 1) * sizeof(struct TreeNode *));
+    if(children == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    n = 0;
+    for(struct TreeNode *child = node->contents; child != NULL;
+        child = child->next) {
+        children[n++] = child;
+    }
+    qsort(children, n, sizeof(struct TreeNode *), compare_names);
+    *count = n;
+    return children;
+}
+
+static void report(struct differ *differ, int kind, int what,
+                   struct TreeNode *a, struct TreeNode *b) {
+    struct ftree_change change;
+    change.kind = kind;
+    change.what = what;
+    change.path = differ->path_len == 0 ? "." : differ->path;
+    change.a = a;
+    change.b = b;
+    differ->callback(&change, differ->arg);
+    differ->changes++;
+}
+
+/*
+ * Appends "/" + name (or just name at the top) to the path of differ.
+ * Returns the length to truncate it back to afterwards.
+ */
+static size_t push_name(struct differ *differ, const char *name) {
+    size_t old_len = differ->path_len;
+    size_t len = strlen(name);
+    size_t new_len = old_len + (old_len > 0) + len;
+    if(new_len + 1 > differ->path_cap) {
+        differ->path_cap = (new_len + 1) * 2;
+        differ->path = realloc(differ->path, differ->path_cap);
+        if(differ->path == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    if(old_len > 0) {
+        differ->path[old_len] = '/';
+    }
+    memcpy(differ->path + new_len - len, name, len + 1);
+    differ->path_len = new_len;
+    return old_len;
+}
+
+/*
+ * Returns the FTREE_DIFF_* bits for what differs between the files a and
+ * b, which have the same type. Hashes are only compared (and so, in a
+ * lazily hashed FTree, only computed) when nothing else differs.
+ */
+static int compare_files(struct TreeNode *a, struct TreeNode *b) {
+    int what = 0;
+    if(a->permissions != b->permissions) {
+        what |= FTREE_DIFF_PERMS;
+    }
+    if(S_ISREG(a->type) && a->size != b->size) {
+        what |= FTREE_DIFF_SIZE;
+    }
+    if(what == 0 && memcmp(ftree_hash(a), ftree_hash(b), BLOCK_SIZE) != 0) {
+        what |= FTREE_DIFF_HASH;
+    }
+    return what;
+}
+
+static void diff_nodes(struct differ *differ, struct TreeNode *a,
+                       struct TreeNode *b);
+
+/*
+ * Reports the differences between the contents of the directories a and
+ * b, merging their files in name order.
+ */
+static void diff_dirs(struct differ *differ, struct TreeNode *a,
+                      struct TreeNode *b) {
+    size_t na, nb, i = 0, j = 0;
+    struct TreeNode **xs = sorted_children(a, &na);
+    struct TreeNode **ys = sorted_children(b, &nb);
+
+    while(i < na || j < nb) {
+        int order = i == na ? 1 : j == nb ? -1 :
+                    strcmp(xs[i]->fname, ys[j]->fname);
+        struct TreeNode *x = order <= 0 ? xs[i++] : NULL;
+        struct TreeNode *y = order >= 0 ? ys[j++] : NULL;
+        size_t len = push_name(differ, x != NULL ? x->fname : y->fname);
+        if(y == NULL) {
+            report(differ, FTREE_REMOVED, 0, x, NULL);
+        }
+        else if(x == NULL) {
+            report(differ, FTREE_ADDED, 0, NULL, y);
+        }
+        else {
+            diff_nodes(differ, x, y);
+        }
+        differ->path_len = len;
+        differ->path[len] = '\0';
+    }
+    free(xs);
+    free(ys);
+}
+
+/*
+ * Reports the differences between a and b, which are the same file in
+ * each tree.
+ */
+static void diff_nodes(struct differ *differ, struct TreeNode *a,
+                       struct TreeNode *b) {
+    if((a->type & S_IFMT) != (b->type & S_IFMT)) {
+        report(differ, FTREE_TYPE_CHANGED, 0, a, b);
+    }
+    else if(S_ISDIR(a->type)) {
+        if(a->permissions != b->permissions) {
+            report(differ, FTREE_MODIFIED, FTREE_DIFF_PERMS, a, b);
+        }
+        // Matching digests mean nothing in the directory changed.
+        if(a->digest == NULL || b->digest == NULL ||
+           memcmp(a->digest, b->digest, BLOCK_SIZE) != 0) {
+            diff_dirs(differ, a, b);
+        }
+    }
+    else if(S_ISREG(a->type) || S_ISLNK(a->type)) {
+        int what = compare_files(a, b);
+        if(what != 0) {
+            report(differ, FTREE_MODIFIED, what, a, b);
+        }
+    }
+    else if(a->permissions != b->permissions) {
+        report(differ, FTREE_MODIFIED, FTREE_DIFF_PERMS, a, b);
+    }
+}
+
+
+/*
+ * Walks the FTrees a and b side by side and calls callback (with arg) for
+ * each difference between them, telling how b differs from a. The roots
+ * are compared with each other whatever their names. The files of each
+ * directory are compared in name order, whatever order they're in in the
+ * trees, and files of lazily hashed FTrees are only hashed if everything
+ * else about them is the same. Directories that have the same digest in
+ * both trees (see FTREE_MERKLE) aren't looked into at all. Sizes are only
+ * compared for regular files that were stat-ed in both trees, so the trees
+ * should be generated with the same flags. Returns the number of
+ * differences.
+ */
+long ftree_diff(struct TreeNode *a, struct TreeNode *b,
+                ftree_diff_callback callback, void *arg) {
+    struct differ differ;
+    differ.callback = callback;
+    differ.arg = arg;
+    differ.changes = 0;
+    differ.path_cap = 256;
+    differ.path_len = 0;
+    differ.path = malloc(differ.path_cap);
+    if(differ.path == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    differ.path[0] = '\0';
+
+    if(a == NULL && b != NULL) {
+        report(&differ, FTREE_ADDED, 0, NULL, b);
+    }
+    else if(a != NULL && b == NULL) {
+        report(&differ, FTREE_REMOVED, 0, a, NULL);
+    }
+    else if(a != NULL) {
+        diff_nodes(&differ, a, b);
+    }
+    free(differ.path);
+    return differ.changes;
+}
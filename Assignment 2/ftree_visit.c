@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ftree.h"
+#include "dir_reader.h"
+
+/*
+ * A visible file of a directory, kept with FTREE_SORTED until its turn.
+ */
+struct visit_item {
+    char *name;
+    mode_t type;                 // From the directory entry, or 0.
+};
+
+/*
+ * A directory whose contents are being visited. Like the frames of
+ * generate_ftree_ex, but nothing is kept of the files once they've been
+ * visited.
+ */
+struct visit_frame {
+    struct dir_reader *dir;
+    struct ftree_entry entry;    // For leave_dir, with offsets into path
+    size_t name_offset;          // for its fname and path.
+    size_t path_len;
+    size_t parent_len;           // Length of the path of its parent.
+    struct visit_item *items;    // With FTREE_SORTED, its files in name
+    size_t nitems;               // order, and the next one to visit.
+    size_t next_item;
+};
+
+/*
+ * State of one run of walk_ftree. Memory held is the path of the file
+ * being visited and a frame per directory enclosing it (with all the
+ * names in the directory, with FTREE_SORTED), whatever the size of the
+ * tree.
+ */
+struct visit {
+    const struct ftree_visitor *visitor;
+    void *arg;
+    int flags;
+    struct visit_frame *stack;
+    size_t depth;
+    size_t cap;
+    char *path;
+    size_t path_len;
+    size_t path_cap;
+};
+
+
+static int compare_items(const void *a, const void *b) {
+    const struct visit_item *x = a, *y = b;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * Appends "/" + name to the path of visit (or makes name the path if it's
+ * empty).
+ */
+static void push_name(struct visit *visit, const char *name) {
+    size_t len = strlen(name);
+    size_t new_len = visit->path_len + (visit->path_len > 0) + len;
+    if(new_len + 1 > visit->path_cap) {
+        visit->path_cap = (new_len + 1) * 2;
+        visit->path = realloc(visit->path, visit->path_cap);
+        if(visit->path == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    if(visit->path_len > 0) {
+        visit->path[visit->path_len] = '/';
+    }
+    memcpy(visit->path + new_len - len, name, len + 1);
+    visit->path_len = new_len;
+}
+
+static void truncate_path(struct visit *visit, size_t len) {
+    visit->path_len = len;
+    visit->path[len] = '\0';
+}
+
+/*
+ * Reads all the visible files of dir into frame, in name order.
+ */
+static void read_items(struct visit_frame *frame, struct dir_reader *dir) {
+    struct dir_entry entry;
+    size_t cap = 0;
+    int ret;
+    while((ret = dir_next(dir, &entry)) == 1) {
+        if(entry.name[0] == '.') {
+            continue;
+        }
+        if(frame->nitems == cap) {
+            cap = cap == 0 ? 64 : cap * 2;
+            frame->items = realloc(frame->items,
+                                   cap * sizeof(struct visit_item));
+            if(frame->items == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        struct visit_item *item = &frame->items[frame->nitems++];
+        item->name = strdup(entry.name);
+        if(item->name == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        item->type = entry.type;
+    }
+    if(ret == -1) {
+        perror("readdir");
+    }
+    if(frame->nitems > 0) {
+        qsort(frame->items, frame->nitems, sizeof(struct visit_item),
+              compare_items);
+    }
+}
+
+/*
+ * Calls leave_dir on the directory at the top of the stack with its path
+ * still in place, then pops it.
+ */
+static void leave_dir(struct visit *visit) {
+    struct visit_frame *frame = &visit->stack[visit->depth - 1];
+    truncate_path(visit, frame->path_len);
+    if(visit->visitor->leave_dir != NULL) {
+        frame->entry.fname = visit->path + frame->name_offset;
+        frame->entry.path = visit->path;
+        visit->visitor->leave_dir(&frame->entry, visit->arg);
+    }
+    for(size_t i = 0; i < frame->nitems; i++) {
+        free(frame->items[i].name);
+    }
+    free(frame->items);
+    if(frame->dir != NULL) {
+        dir_close(frame->dir);
+    }
+    truncate_path(visit, frame->parent_len);
+    visit->depth--;
+}
+
+/*
+ * Visits the file whose path is the path of visit, which is name relative
+ * to dirfd, and whose path was parent_len long before name was added.
+ * info is its status, or NULL if it wasn't needed, in which case type is
+ * its S_IF* type from the directory entry. A directory is pushed onto the
+ * stack to have its contents visited.
+ */
+static void visit_file(struct visit *visit, int dirfd, const char *name,
+                       size_t parent_len, const struct stat *info,
+                       mode_t type) {
+    const char *fname = strrchr(visit->path + parent_len, '/') == NULL ?
+                        visit->path + parent_len :
+                        strrchr(visit->path + parent_len, '/') + 1;
+    struct ftree_entry entry;
+    entry.fname = fname;
+    entry.path = visit->path;
+    // The root is always stat-ed, so FTREE_NO_PERMS has to clear its
+    // permissions.
+    entry.permissions = info == NULL || (visit->depth == 0 &&
+                                         (visit->flags & FTREE_NO_PERMS)) ?
+                        0 : info->st_mode & 0777;
+    entry.type = type;
+    entry.size = info == NULL ? 0 : info->st_size;
+    entry.mtime = info == NULL ? 0 : info->st_mtim.tv_sec * 1000000000LL +
+                                     info->st_mtim.tv_nsec;
+    entry.depth = visit->depth;
+
+    if(!S_ISDIR(type)) {
+        if(visit->visitor->file != NULL) {
+            visit->visitor->file(&entry, visit->arg);
+        }
+        truncate_path(visit, parent_len);
+        return;
+    }
+
+    int open_dir = visit->visitor->enter_dir == NULL ||
+                   visit->visitor->enter_dir(&entry, visit->arg);
+    if(visit->depth == visit->cap) {
+        visit->cap = visit->cap == 0 ? 64 : visit->cap * 2;
+        visit->stack = realloc(visit->stack,
+                               visit->cap * sizeof(struct visit_frame));
+        if(visit->stack == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct visit_frame *frame = &visit->stack[visit->depth++];
+    memset(frame, 0, sizeof(*frame));
+    frame->entry = entry;
+    frame->name_offset = fname - visit->path;
+    frame->path_len = visit->path_len;
+    frame->parent_len = parent_len;
+    if(open_dir) {
+        frame->dir = dir_open(dirfd, name);
+        if(frame->dir == NULL) {
+            perror("opendir");
+        }
+        else if(visit->flags & FTREE_SORTED) {
+            read_items(frame, frame->dir);
+        }
+    }
+    // Leave a directory that can't (or needn't) be read right away.
+    if(frame->dir == NULL) {
+        leave_dir(visit);
+    }
+}
+
+/*
+ * Visits the next visible file of the directory on top of the stack, or
+ * leaves the directory when there are no more.
+ */
+static void visit_step(struct visit *visit) {
+    struct visit_frame *frame = &visit->stack[visit->depth - 1];
+    const char *name;
+    mode_t type;
+    if(visit->flags & FTREE_SORTED) {
+        if(frame->next_item == frame->nitems) {
+            leave_dir(visit);
+            return;
+        }
+        name = frame->items[frame->next_item].name;
+        type = frame->items[frame->next_item].type;
+        frame->next_item++;
+    }
+    else {
+        struct dir_entry entry;
+        int ret;
+        while((ret = dir_next(frame->dir, &entry)) == 1 &&
+              entry.name[0] == '.') {
+        }
+        if(ret != 1) {
+            if(ret == -1) {
+                perror("readdir");
+            }
+            leave_dir(visit);
+            return;
+        }
+        name = entry.name;
+        type = entry.type;
+    }
+
+    // As in generate_ftree_ex, only stat when the type or the permissions
+    // are needed.
+    struct stat info;
+    int fd = dir_fd(frame->dir);
+    int need_stat = !(visit->flags & FTREE_NO_PERMS) || type == 0;
+    if(need_stat) {
+        if(fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+            // Files that can't be lstat-ed are left out.
+            perror("lstat");
+            return;
+        }
+        type = info.st_mode & S_IFMT;
+    }
+    size_t parent_len = visit->path_len;
+    push_name(visit, name);
+    visit_file(visit, fd, name, parent_len, need_stat ? &info : NULL, type);
+}
+
+
+/*
+ * Visits the files under the path fname in the same order, and with the
+ * same information, as print_ftree would print the FTree generated from
+ * it with the same flags, calling the callbacks of visitor (with arg) on
+ * each. Files aren't hashed, and nothing of a file is kept once it's been
+ * visited, so memory use depends on how deep the tree is and (with
+ * FTREE_SORTED) how big its directories are, but not on its size.
+ * Only FTREE_SORTED and FTREE_NO_PERMS of flags are used.
+ * Returns -1 if fname can't be lstat-ed, or 0.
+ */
+int walk_ftree(const char *fname, int flags,
+               const struct ftree_visitor *visitor, void *arg) {
+    struct stat info;
+
+    if(fname == NULL) {
+        return -1;
+    }
+    if (lstat(fname, &info) != 0) {
+        perror("lstat");
+        return -1;
+    }
+
+    struct visit visit;
+    memset(&visit, 0, sizeof(visit));
+    visit.visitor = visitor;
+    visit.arg = arg;
+    visit.flags = flags;
+    push_name(&visit, fname);
+    visit_file(&visit, AT_FDCWD, fname, 0, &info, info.st_mode & S_IFMT);
+    while(visit.depth > 0) {
+        visit_step(&visit);
+    }
+
+    free(visit.stack);
+    free(visit.path);
+    return 0;
+}
@@ -0,0 +1,610 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ftree.h"
+#include "hash.h"
+#include "arena.h"
+#include "dir_reader.h"
+#include "uring_scan.h"
+
+// Most threads generate_ftree_parallel uses.
+#define MAX_THREADS 256
+
+// Number of files a thread takes to hash at once.
+#define HASH_BATCH 16
+
+// Operations kept in flight by all the threads' io_urings together with
+// FTREE_URING, and the fewest kept by each one.
+#define URING_DEPTH 256
+#define URING_MIN_DEPTH 32
+
+/*
+ * A directory whose contents haven't been read yet.
+ */
+struct dir_task {
+    struct TreeNode *node;
+    const char *path;
+};
+
+/*
+ * A file whose hash is filled in by the hashing stage.
+ */
+struct hash_job {
+    struct TreeNode *node;
+    const char *path;
+    int regular;                 // The hash cache can be used.
+};
+
+/*
+ * A visible file in the directory being read.
+ */
+struct dir_item {
+    const char *path;
+    const char *name;            // The last part of path.
+    mode_t type;                 // From the directory entry, or 0.
+    long stat;                   // Index of its status, or -1 if not needed.
+};
+
+struct generator;
+
+/*
+ * State of one thread. Directories it finds are pushed onto the back of
+ * its deque and popped from the back again, so each thread works depth
+ * first; idle threads steal from the front, which holds the directories
+ * nearest the root and so (usually) the most work.
+ */
+struct worker {
+    pthread_mutex_t lock;        // Protects the deque.
+    struct dir_task *tasks;
+    size_t head;                 // Index of the oldest task.
+    size_t tail;                 // Index just past the newest task.
+    size_t cap;
+
+    struct hash_job *jobs;       // Files found by this thread.
+    size_t njobs;
+    size_t jobs_cap;
+    size_t next_job;             // Next job to be taken by the hash stage.
+
+    struct ftree_arena *arena;   // Nodes, names and hashes.
+    struct ftree_arena *scratch; // Paths, freed with the generator.
+    struct TreeNode **children;  // Buffer for sorting a directory.
+    size_t children_cap;
+
+    struct dir_item *items;      // Files of the directory being read.
+    size_t items_cap;
+    const char **stat_names;     // Names of the items that need a stat,
+    struct stat *stat_info;      // their statuses
+    int *stat_errors;            // and the errno if that failed.
+    size_t stats_cap;
+
+    struct uring_scanner *ring;  // With FTREE_URING, if it's supported.
+
+    struct generator *gen;
+    unsigned int seed;           // For picking threads to steal from.
+    pthread_t tid;
+};
+
+/*
+ * State shared by the threads generating one FTree.
+ */
+struct generator {
+    struct worker *workers;
+    int nworkers;
+    int flags;
+
+    long queued;                 // Tasks waiting in some deque.
+    long pending;                // Tasks queued or being worked on.
+    int idle;                    // Threads waiting for a task.
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+
+/*
+ * Returns a copy of dir + "/" + name allocated from arena.
+ */
+static char *join_path(struct ftree_arena *arena, const char *dir,
+                       const char *name) {
+    size_t dirlen = strlen(dir), namelen = strlen(name);
+    char *path = arena_alloc(arena, dirlen + namelen + 2, 1);
+    memcpy(path, dir, dirlen);
+    path[dirlen] = '/';
+    memcpy(path + dirlen + 1, name, namelen + 1);
+    return path;
+}
+
+/*
+ * Queues the directory node at path to have its contents read.
+ */
+static void push_task(struct worker *self, struct TreeNode *node,
+                      const char *path) {
+    struct generator *gen = self->gen;
+    // Count the task before anyone can take it, so that neither count can
+    // drop below the real number.
+    __atomic_add_fetch(&gen->pending, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&gen->queued, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&self->lock);
+    if(self->tail == self->cap) {
+        // Slide the tasks down to the front, or grow the deque.
+        if(self->head > self->cap / 2) {
+            memmove(self->tasks, self->tasks + self->head,
+                    (self->tail - self->head) * sizeof(struct dir_task));
+        }
+        else {
+            self->cap = self->cap == 0 ? 256 : self->cap * 2;
+            self->tasks = realloc(self->tasks,
+                                  self->cap * sizeof(struct dir_task));
+            if(self->tasks == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            memmove(self->tasks, self->tasks + self->head,
+                    (self->tail - self->head) * sizeof(struct dir_task));
+        }
+        self->tail -= self->head;
+        self->head = 0;
+    }
+    self->tasks[self->tail].node = node;
+    self->tasks[self->tail].path = path;
+    self->tail++;
+    pthread_mutex_unlock(&self->lock);
+
+    if(__atomic_load_n(&gen->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&gen->idle_lock);
+        pthread_cond_signal(&gen->idle_cond);
+        pthread_mutex_unlock(&gen->idle_lock);
+    }
+}
+
+/*
+ * Takes a task from the back (own == 1) or the front (own == 0) of the
+ * deque of worker. Returns 1 if there was one.
+ */
+static int take_task(struct worker *worker, int own, struct dir_task *task) {
+    int found = 0;
+    pthread_mutex_lock(&worker->lock);
+    if(worker->head < worker->tail) {
+        if(own) {
+            *task = worker->tasks[--worker->tail];
+        }
+        else {
+            *task = worker->tasks[worker->head++];
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    if(found) {
+        __atomic_sub_fetch(&worker->gen->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return found;
+}
+
+/*
+ * Finds the next directory for self to read: its own newest one, or else
+ * the oldest one of another thread. Waits while other threads are busy
+ * and might still find more. Returns 0 once every directory has been read.
+ */
+static int next_task(struct worker *self, struct dir_task *task) {
+    struct generator *gen = self->gen;
+    while(1) {
+        if(take_task(self, 1, task)) {
+            return 1;
+        }
+        int start = rand_r(&self->seed) % gen->nworkers;
+        for(int i = 0; i < gen->nworkers; i++) {
+            struct worker *victim = &gen->workers[(start + i) % gen->nworkers];
+            if(victim != self && take_task(victim, 0, task)) {
+                return 1;
+            }
+        }
+
+        pthread_mutex_lock(&gen->idle_lock);
+        __atomic_add_fetch(&gen->idle, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&gen->queued, __ATOMIC_SEQ_CST) == 0 &&
+              __atomic_load_n(&gen->pending, __ATOMIC_SEQ_CST) > 0) {
+            pthread_cond_wait(&gen->idle_cond, &gen->idle_lock);
+        }
+        __atomic_sub_fetch(&gen->idle, 1, __ATOMIC_SEQ_CST);
+        int done = __atomic_load_n(&gen->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&gen->idle_lock);
+        if(done) {
+            return 0;
+        }
+    }
+}
+
+static void finish_task(struct worker *self) {
+    struct generator *gen = self->gen;
+    if(__atomic_sub_fetch(&gen->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&gen->idle_lock);
+        pthread_cond_broadcast(&gen->idle_cond);
+        pthread_mutex_unlock(&gen->idle_lock);
+    }
+}
+
+static int compare_names(const void *a, const void *b) {
+    const struct TreeNode *x = *(struct TreeNode * const *)a;
+    const struct TreeNode *y = *(struct TreeNode * const *)b;
+    return strcmp(x->fname, y->fname);
+}
+
+/*
+ * Fills in the fields of node for the file named name, and queues whatever
+ * else needs doing to it: reading the contents of a directory, or hashing
+ * a file (unless the hash cache has it). info is the file's status, or
+ * NULL if it wasn't needed, in which case type is its S_IF* type from the
+ * directory entry.
+ */
+static void fill_node(struct worker *self, struct TreeNode *node,
+                      const char *path, const char *name,
+                      const struct stat *info, mode_t type) {
+    node->fname = arena_strndup(self->arena, name, strlen(name));
+    node->permissions = info == NULL ? 0 : info->st_mode & 0777;
+    node->contents = NULL;
+    node->hash = NULL;
+    node->digest = NULL;
+    node->next = NULL;
+    set_node_status(node, info, type);
+
+    if(S_ISDIR(type)) {
+        push_task(self, node, path);
+    }
+    else if((S_ISREG(type) || S_ISLNK(type)) &&
+            (self->gen->flags & FTREE_LAZY_HASH)) {
+        // Paths are freed with the generator, so keep a copy.
+        node->path = alloc_node_path(self->arena, NULL, path);
+    }
+    else if(S_ISREG(type) || S_ISLNK(type)) {
+        node->hash = arena_alloc(self->arena, BLOCK_SIZE, 1);
+        if(S_ISREG(type) && info != NULL &&
+           hash_cache_get(info, node->hash)) {
+            return;
+        }
+        if(self->njobs == self->jobs_cap) {
+            self->jobs_cap = self->jobs_cap == 0 ? 1024 : self->jobs_cap * 2;
+            self->jobs = realloc(self->jobs,
+                                 self->jobs_cap * sizeof(struct hash_job));
+            if(self->jobs == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        self->jobs[self->njobs].node = node;
+        self->jobs[self->njobs].path = path;
+        self->jobs[self->njobs].regular = S_ISREG(type);
+        self->njobs++;
+    }
+}
+
+/*
+ * Grows the array *items of *cap elements of size size to hold at least
+ * one more than n.
+ */
+static void *grow_array(void *items, size_t *cap, size_t n, size_t size) {
+    if(n < *cap) {
+        return items;
+    }
+    *cap = *cap == 0 ? 256 : *cap * 2;
+    items = realloc(items, *cap * size);
+    if(items == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return items;
+}
+
+/*
+ * Doubles the room for statuses of items of self.
+ */
+static void grow_stats(struct worker *self) {
+    self->stats_cap = self->stats_cap == 0 ? 256 : self->stats_cap * 2;
+    self->stat_names = realloc(self->stat_names,
+                               self->stats_cap * sizeof(char *));
+    self->stat_info = realloc(self->stat_info,
+                              self->stats_cap * sizeof(struct stat));
+    self->stat_errors = realloc(self->stat_errors,
+                                self->stats_cap * sizeof(int));
+    if(self->stat_names == NULL || self->stat_info == NULL ||
+       self->stat_errors == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+}
+
+/*
+ * Stats the items of self that need it, relative to the directory open on
+ * fd: all at once with an io_uring, or else one after another.
+ */
+static void stat_items(struct worker *self, int fd, size_t nstats) {
+    if(self->ring != NULL) {
+        uring_stat_batch(self->ring, fd, self->stat_names, nstats,
+                         self->stat_info, self->stat_errors);
+        return;
+    }
+    for(size_t i = 0; i < nstats; i++) {
+        self->stat_errors[i] = 0;
+        if(fstatat(fd, self->stat_names[i], &self->stat_info[i],
+                   AT_SYMLINK_NOFOLLOW) != 0) {
+            self->stat_errors[i] = errno;
+        }
+    }
+}
+
+/*
+ * Adds nodes for the visible files in the directory of task to it, in
+ * the order readdir returns them or sorted by name with FTREE_SORTED.
+ */
+static void read_dir(struct worker *self, struct dir_task *task) {
+    struct dir_reader *dir = dir_open(AT_FDCWD, task->path);
+    struct dir_entry entry;
+    size_t nitems = 0, nstats = 0, nchildren = 0;
+    int ret;
+    if(dir == NULL) {
+        perror("opendir");
+        return;
+    }
+
+    // Files are only stat-ed when the directory entry doesn't give the
+    // type, or more than the type is needed.
+    int flags = self->gen->flags;
+    int need_info = (flags & FTREE_LAZY_HASH) || hash_cache_enabled();
+    size_t dirlen = strlen(task->path);
+    while((ret = dir_next(dir, &entry)) == 1) {
+        if(entry.name[0] != '.') {
+            self->items = grow_array(self->items, &self->items_cap, nitems,
+                                     sizeof(struct dir_item));
+            struct dir_item *item = &self->items[nitems++];
+            item->path = join_path(self->scratch, task->path, entry.name);
+            item->name = item->path + dirlen + 1;
+            item->type = entry.type;
+            item->stat = -1;
+            if(!(flags & FTREE_NO_PERMS) || entry.type == 0 ||
+               (S_ISREG(entry.type) && need_info)) {
+                if(nstats == self->stats_cap) {
+                    grow_stats(self);
+                }
+                self->stat_names[nstats] = item->name;
+                item->stat = nstats++;
+            }
+        }
+    }
+    if(ret == -1) {
+        perror("readdir");
+    }
+    stat_items(self, dir_fd(dir), nstats);
+    dir_close(dir);
+
+    for(size_t i = 0; i < nitems; i++) {
+        struct dir_item *item = &self->items[i];
+        struct stat *info = NULL;
+        mode_t type = item->type;
+        if(item->stat != -1) {
+            if(self->stat_errors[item->stat] != 0) {
+                errno = self->stat_errors[item->stat];
+                perror("lstat");
+                continue;
+            }
+            info = &self->stat_info[item->stat];
+            type = info->st_mode & S_IFMT;
+        }
+        self->children = grow_array(self->children, &self->children_cap,
+                                    nchildren, sizeof(struct TreeNode *));
+        struct TreeNode *child = arena_new_node(self->arena);
+        self->children[nchildren++] = child;
+        fill_node(self, child, item->path, item->name, info, type);
+    }
+
+    if(self->gen->flags & FTREE_SORTED) {
+        qsort(self->children, nchildren, sizeof(struct TreeNode *),
+              compare_names);
+    }
+    struct TreeNode **tail = &task->node->contents;
+    for(size_t i = 0; i < nchildren; i++) {
+        *tail = self->children[i];
+        tail = &self->children[i]->next;
+    }
+}
+
+/*
+ * Computes the hash of the file of job. Files that can't be read get an
+ * empty hash, as in generate_ftree.
+ */
+static void run_hash_job(struct hash_job *job) {
+    struct stat info;
+    int cached = job->regular && hash_cache_enabled() &&
+                 lstat(job->path, &info) == 0 && S_ISREG(info.st_mode);
+    if(hash_cached(job->node->hash, AT_FDCWD, job->path,
+                   cached ? &info : NULL) == NULL) {
+        perror("open");
+        memset(job->node->hash, '\0', BLOCK_SIZE);
+    }
+}
+
+/*
+ * Hashes the files found by all the threads: first the ones this thread
+ * found, then whatever the others haven't got to yet. With an io_uring,
+ * the files are queued on it to be hashed many at a time.
+ */
+static void hash_files(struct worker *self) {
+    struct generator *gen = self->gen;
+    int index = self - gen->workers;
+    int use_cache = hash_cache_enabled();
+    for(int i = 0; i < gen->nworkers; i++) {
+        struct worker *owner = &gen->workers[(index + i) % gen->nworkers];
+        size_t start;
+        while((start = __atomic_fetch_add(&owner->next_job, HASH_BATCH,
+                                          __ATOMIC_RELAXED)) < owner->njobs) {
+            size_t end = start + HASH_BATCH < owner->njobs ?
+                         start + HASH_BATCH : owner->njobs;
+            for(size_t j = start; j < end; j++) {
+                struct hash_job *job = &owner->jobs[j];
+                if(self->ring != NULL) {
+                    uring_hash_file(self->ring, job->path, job->node->hash,
+                                    job->regular && use_cache);
+                }
+                else {
+                    run_hash_job(job);
+                }
+            }
+        }
+    }
+    if(self->ring != NULL) {
+        uring_hash_wait(self->ring);
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *self = arg;
+    struct dir_task task;
+    while(next_task(self, &task)) {
+        read_dir(self, &task);
+        finish_task(self);
+    }
+    // next_task only gives up once every directory has been read, so all
+    // the threads' lists of files are complete.
+    hash_files(self);
+    return NULL;
+}
+
+/*
+ * Sets the digests of the directories in the subtree rooted at node,
+ * deepest first, once every file in it has been hashed.
+ */
+static void digest_tree(struct ftree_arena *arena, struct TreeNode *node) {
+    if(!S_ISDIR(node->type)) {
+        return;
+    }
+    for(struct TreeNode *child = node->contents; child != NULL;
+        child = child->next) {
+        digest_tree(arena, child);
+    }
+    digest_dir(arena, node);
+}
+
+
+/*
+ * Returns the FTree rooted at the path fname, like generate_ftree, but
+ * reads directories and hashes files on 'threads' threads at once (one per
+ * online CPU if threads is 0). The files of each directory come in the
+ * same order as with generate_ftree, or sorted by name if flags has
+ * FTREE_SORTED. FTREE_LAZY_HASH leaves files to be hashed by ftree_hash,
+ * as with generate_ftree_ex. With FTREE_URING each thread keeps many stats, opens and
+ * reads in flight through its own io_uring, falling back to doing them
+ * one at a time if io_uring isn't available. With FTREE_MERKLE the
+ * directories are given digests once all the threads are done.
+ */
+struct TreeNode *generate_ftree_parallel(const char *fname, int threads,
+                                         int flags) {
+    struct stat info;
+
+    if(fname == NULL) {
+        return NULL;
+    }
+
+    if (lstat(fname, &info) != 0) {
+        perror("lstat");
+        return NULL;
+    }
+
+    if(threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+    if(flags & FTREE_MERKLE) {
+        flags &= ~FTREE_LAZY_HASH;
+    }
+
+    struct generator gen;
+    memset(&gen, 0, sizeof(gen));
+    gen.nworkers = threads;
+    gen.flags = flags;
+    gen.workers = calloc(threads, sizeof(struct worker));
+    struct ftree_arena *root_arena;
+    struct TreeNode *root = arena_new_tree(&root_arena);
+    if(gen.workers == NULL || root == NULL) {
+        perror("malloc");
+        free(gen.workers);
+        if(root != NULL) {
+            arena_free_tree(root);
+        }
+        return NULL;
+    }
+    pthread_mutex_init(&gen.idle_lock, NULL);
+    pthread_cond_init(&gen.idle_cond, NULL);
+    for(int i = 0; i < threads; i++) {
+        struct worker *worker = &gen.workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->gen = &gen;
+        worker->seed = i + 1;
+        worker->arena = arena_new();
+        worker->scratch = arena_new();
+        if(worker->arena == NULL || worker->scratch == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        // Without io_uring the work is just done synchronously.
+        if(flags & FTREE_URING) {
+            worker->ring = uring_scanner_new(URING_DEPTH / threads >
+                                             URING_MIN_DEPTH ?
+                                             URING_DEPTH / threads :
+                                             URING_MIN_DEPTH);
+        }
+    }
+
+    // The root is filled in by the first thread before any others start.
+    const char *name = strrchr(fname, '/') == NULL ? fname :
+                       strrchr(fname, '/') + 1;
+    fill_node(&gen.workers[0], root, fname, name, &info,
+              info.st_mode & S_IFMT);
+    if(flags & FTREE_NO_PERMS) {
+        root->permissions = 0;
+    }
+
+    int started = 1;
+    for(; started < threads; started++) {
+        if(pthread_create(&gen.workers[started].tid, NULL, worker_main,
+                          &gen.workers[started]) != 0) {
+            // Make do with the threads that did start.
+            perror("pthread_create");
+            break;
+        }
+    }
+    worker_main(&gen.workers[0]);
+    for(int i = 1; i < started; i++) {
+        pthread_join(gen.workers[i].tid, NULL);
+    }
+
+    for(int i = 0; i < threads; i++) {
+        struct worker *worker = &gen.workers[i];
+        arena_merge(root_arena, worker->arena);
+        arena_destroy(worker->scratch);
+        free(worker->tasks);
+        free(worker->jobs);
+        free(worker->children);
+        free(worker->items);
+        free(worker->stat_names);
+        free(worker->stat_info);
+        free(worker->stat_errors);
+        uring_scanner_free(worker->ring);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    pthread_cond_destroy(&gen.idle_cond);
+    pthread_mutex_destroy(&gen.idle_lock);
+    free(gen.workers);
+    if(flags & FTREE_MERKLE) {
+        digest_tree(root_arena, root);
+    }
+    return root;
+}
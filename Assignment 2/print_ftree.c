@@ -1,16 +1,183 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "ftree.h"
 
 
+/*
+ * Prints a file found by walk_ftree the way print_ftree prints its node.
+ */
+static void print_entry(const struct ftree_entry *entry, void *arg) {
+    printf("%*s", entry->depth * 2, "");
+    if(!S_ISREG(entry->type) && !S_ISLNK(entry->type)) {
+        printf("===== %s (%o) =====\n", entry->fname, entry->permissions);
+    }
+    else {
+        printf("%s (%o)\n", entry->fname, entry->permissions);
+    }
+}
+
+static int print_dir(const struct ftree_entry *entry, void *arg) {
+    print_entry(entry, arg);
+    return 1;
+}
+
+/*
+ * Prints one difference found by ftree_diff.
+ */
+static void print_change(const struct ftree_change *change, void *arg) {
+    switch(change->kind) {
+    case FTREE_ADDED:
+        printf("added: %s\n", change->path);
+        break;
+    case FTREE_REMOVED:
+        printf("removed: %s\n", change->path);
+        break;
+    case FTREE_TYPE_CHANGED:
+        printf("type changed: %s\n", change->path);
+        break;
+    default:
+        printf("modified: %s (", change->path);
+        const char *sep = "";
+        if(change->what & FTREE_DIFF_SIZE) {
+            printf("%ssize", sep);
+            sep = ", ";
+        }
+        if(change->what & FTREE_DIFF_PERMS) {
+            printf("%spermissions", sep);
+            sep = ", ";
+        }
+        if(change->what & FTREE_DIFF_HASH) {
+            printf("%shash", sep);
+        }
+        printf(")\n");
+    }
+}
+
+/*
+ * Returns the number of threads given to -j as arg, or -1 if it isn't a
+ * whole number from 0 (one per CPU) up.
+ */
+static int parse_threads(const char *arg) {
+    char *end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    if(errno != 0 || end == arg || *end != '\0' || n < 0 || n > INT_MAX) {
+        return -1;
+    }
+    return n;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        printf("Usage:\n\tftree DIRECTORY\n");
+    int threads = 1;
+    int flags = 0;
+    int load = 0;
+    const char *save_path = NULL;
+    const char *diff_path = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "j:sumo:id:")) != -1) {
+        switch(opt) {
+        case 'j':
+            threads = parse_threads(optarg);
+            if(threads < 0) {
+                fprintf(stderr, "print_ftree: bad number of threads: %s\n",
+                        optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            flags |= FTREE_SORTED;
+            break;
+        case 'u':
+            flags |= FTREE_URING;
+            break;
+        case 'm':
+            flags |= FTREE_MERKLE;
+            break;
+        case 'o':
+            save_path = optarg;
+            break;
+        case 'i':
+            load = 1;
+            break;
+        case 'd':
+            diff_path = optarg;
+            break;
+        default:
+            threads = -1;
+        }
+    }
+    if (argc - optind != 1 || threads < 0) {
+        printf("Usage:\n\tftree [-j THREADS] [-s] [-u] [-m] [-o SNAPSHOT] "
+               "DIRECTORY\n\tftree -i SNAPSHOT\n"
+               "\tftree [-j THREADS] [-s] [-u] [-m] -d SNAPSHOT DIRECTORY\n");
         return 0;
     }
 
-    struct TreeNode *root = generate_ftree(argv[1]);
-    print_ftree(root);
+    // Print a tree saved with -o instead of scanning one.
+    if(load) {
+        struct FlatTree *tree = ftree_load(argv[optind]);
+        if(tree == NULL) {
+            perror(argv[optind]);
+            return 1;
+        }
+        print_flat_ftree(tree);
+        free_flat_ftree(tree);
+        return 0;
+    }
 
-    return 0;
-}
+    // Just printing needs no tree, so print each file as it's found.
+    if(threads == 1 && !(flags & FTREE_URING) && save_path == NULL &&
+       diff_path == NULL) {
+        struct ftree_visitor printer = {print_dir, print_entry, NULL};
+        return walk_ftree(argv[optind], flags, &printer, NULL) != 0;
+    }
+
+    // Hashes are never printed, so don't read any files unless -m asks for
+    // directory digests.
+    flags |= FTREE_LAZY_HASH;
+    struct TreeNode *root;
+    if(threads == 1) {
+        root = generate_ftree_ex(argv[optind], flags);
+    }
+    else {
+        root = generate_ftree_parallel(argv[optind], threads, flags);
+    }
+    if(root == NULL) { // It's been reported already.
+        return 1;
+    }
 
+    // Print how the tree differs from a saved one instead of the tree.
+    if(diff_path != NULL) {
+        struct FlatTree *tree = ftree_load(diff_path);
+        if(tree == NULL) {
+            perror(diff_path);
+            free_ftree(root);
+            return 1;
+        }
+        struct TreeNode *old_root = unflatten_ftree(tree);
+        ftree_diff(old_root, root, print_change, NULL);
+        free_ftree(old_root);
+        free_flat_ftree(tree);
+    }
+    else {
+        print_ftree(root);
+    }
+
+    // Saving the tree hashes all of its files.
+    int ret = 0;
+    if(save_path != NULL) {
+        struct FlatTree *tree = flatten_ftree(root);
+        if(tree == NULL || ftree_save(tree, save_path) != 0) {
+            perror(save_path);
+            ret = 1;
+        }
+        free_flat_ftree(tree);
+    }
+    free_ftree(root);
+
+    return ret;
+}
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "ftree.h"
+#include "hash.h"
+
+/*
+ * Snapshots of flat FTrees saved to disk.
+ *
+ * A snapshot is a header followed by the three arrays of the flat FTree
+ * exactly as they are in memory: the node table, the string pool and the
+ * hash table, each starting on a SNAPSHOT_ALIGN boundary. Loading one just
+ * maps the file and points a FlatTree at the arrays in the mapping, so it
+ * takes the same time whatever the size of the tree, and pages of the
+ * tree are only read from disk when they're used.
+ *
+ * Loading checks the header and makes one pass over the node table, so
+ * that every name, hash and subtree a node refers to is inside the
+ * snapshot, and walking the tree can't run off the end of it or go round
+ * in circles however the file was damaged.
+ *
+ * Numbers are stored in the byte order of the machine that saved the
+ * snapshot; a snapshot from a machine with the other byte order is
+ * rejected rather than converted.
+ */
+
+#define SNAPSHOT_MAGIC "FTSNAPSH"
+#define SNAPSHOT_VERSION 3
+
+// Written as is, so it reads back differently in the other byte order.
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+#define SNAPSHOT_ALIGN 64
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t count;              // Nodes in the node table.
+    uint32_t nhashes;
+    uint32_t hash_size;
+    uint32_t node_size;          // sizeof(struct FlatNode) when saved.
+    uint64_t names_len;
+    uint64_t nodes_offset;
+    uint64_t names_offset;
+    uint64_t hashes_offset;
+    uint64_t size;               // Of the whole file.
+};
+
+static const char padding[SNAPSHOT_ALIGN];
+
+
+static uint64_t align_up(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+/*
+ * Writes all len bytes of buf to fd. Returns -1 on error.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Writes len bytes of buf to fd at offset *pos, padded up to the next
+ * multiple of SNAPSHOT_ALIGN, and advances *pos past them.
+ */
+static int write_section(int fd, const void *buf, size_t len,
+                         uint64_t *pos) {
+    uint64_t end = align_up(*pos + len);
+    if(write_all(fd, buf, len) != 0 ||
+       write_all(fd, padding, end - *pos - len) != 0) {
+        return -1;
+    }
+    *pos = end;
+    return 0;
+}
+
+/*
+ * Saves the flat FTree tree as a snapshot at path, replacing whatever was
+ * there only once the whole snapshot has been written. Returns 0 on
+ * success and -1 (with errno set) on error.
+ */
+int ftree_save(const struct FlatTree *tree, const char *path) {
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.count = tree->count;
+    header.nhashes = tree->nhashes;
+    header.hash_size = tree->hash_size;
+    header.node_size = sizeof(struct FlatNode);
+    header.names_len = tree->names_len;
+    header.nodes_offset = align_up(sizeof(header));
+    header.names_offset = align_up(header.nodes_offset +
+                                   (uint64_t)tree->count *
+                                   sizeof(struct FlatNode));
+    header.hashes_offset = align_up(header.names_offset + tree->names_len);
+    header.size = align_up(header.hashes_offset +
+                           (uint64_t)tree->nhashes * tree->hash_size);
+
+    char *tmp_path = malloc(strlen(path) + 5);
+    if(tmp_path == NULL) {
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        free(tmp_path);
+        return -1;
+    }
+
+    uint64_t pos = 0;
+    int ret = 0;
+    if(write_section(fd, &header, sizeof(header), &pos) != 0 ||
+       write_section(fd, tree->nodes, tree->count * sizeof(struct FlatNode),
+                     &pos) != 0 ||
+       write_section(fd, tree->names, tree->names_len, &pos) != 0 ||
+       write_section(fd, tree->hashes,
+                     (size_t)tree->nhashes * tree->hash_size, &pos) != 0) {
+        ret = -1;
+    }
+    // Make sure the data is on disk before the rename is, so that a crash
+    // can't leave an empty snapshot in place of the old one.
+    if(ret == 0 && fsync(fd) != 0) {
+        ret = -1;
+    }
+    if(close(fd) != 0 || (ret == 0 && rename(tmp_path, path) != 0)) {
+        ret = -1;
+    }
+    if(ret != 0) {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+    }
+    free(tmp_path);
+    return ret;
+}
+
+/*
+ * Returns 1 if header describes a snapshot this build can use that fits
+ * in a file of size bytes.
+ */
+static int check_header(const struct snapshot_header *header, off_t size) {
+    uint64_t nodes_len = (uint64_t)header->count * sizeof(struct FlatNode);
+    uint64_t hashes_len = (uint64_t)header->nhashes * header->hash_size;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != SNAPSHOT_VERSION ||
+       header->byte_order != SNAPSHOT_BYTE_ORDER ||
+       header->node_size != sizeof(struct FlatNode) ||
+       header->hash_size != BLOCK_SIZE ||
+       header->size != (uint64_t)size) {
+        return 0;
+    }
+    // Each section must be aligned and fit before the next, which is
+    // checked without adding anything that could overflow.
+    return header->nodes_offset % SNAPSHOT_ALIGN == 0 &&
+           header->names_offset % SNAPSHOT_ALIGN == 0 &&
+           header->hashes_offset % SNAPSHOT_ALIGN == 0 &&
+           header->nodes_offset >= sizeof(struct snapshot_header) &&
+           header->nodes_offset <= header->names_offset &&
+           nodes_len <= header->names_offset - header->nodes_offset &&
+           header->names_offset <= header->hashes_offset &&
+           header->names_len <= header->hashes_offset - header->names_offset &&
+           header->hashes_offset <= header->size &&
+           hashes_len <= header->size - header->hashes_offset;
+}
+
+/*
+ * Returns 1 if every node of tree, whose arrays are those of a snapshot
+ * with a valid header, names a '\0' terminated string in the string pool
+ * and a hash in the hash table (or FLAT_DIR, but never for a regular file
+ * or symbolic link, which are always saved with theirs), and if the
+ * subtrees of the nodes nest: each one ends after its node, and inside the
+ * subtree of its parent, and the root's covers the whole table. Returns 0
+ * if not, and -1 if memory ran out checking.
+ */
+static int check_nodes(const struct FlatTree *tree) {
+    if(tree->count == 0) {
+        return 1;
+    }
+    if(tree->names_len == 0 || tree->names[tree->names_len - 1] != '\0' ||
+       tree->nodes[0].end != tree->count) {
+        return 0;
+    }
+
+    // Ends of the subtrees enclosing the node being checked, innermost
+    // last.
+    uint32_t *ends = NULL;
+    size_t depth = 0, cap = 0;
+    int valid = 1;
+    for(uint32_t i = 0; i < tree->count; i++) {
+        const struct FlatNode *node = &tree->nodes[i];
+        while(depth > 0 && ends[depth - 1] <= i) {
+            depth--;
+        }
+        if(node->name >= tree->names_len ||
+           (node->hash != FLAT_DIR && node->hash >= tree->nhashes) ||
+           ((S_ISREG(node->type) || S_ISLNK(node->type)) &&
+            node->hash == FLAT_DIR) ||
+           node->end <= i ||
+           node->end > (depth > 0 ? ends[depth - 1] : tree->count)) {
+            valid = 0;
+            break;
+        }
+        if(depth == cap) {
+            cap = cap == 0 ? 64 : cap * 2;
+            uint32_t *grown = realloc(ends, cap * sizeof(uint32_t));
+            if(grown == NULL) {
+                valid = -1;
+                break;
+            }
+            ends = grown;
+        }
+        ends[depth++] = node->end;
+    }
+    free(ends);
+    return valid;
+}
+
+/*
+ * Returns the flat FTree saved as a snapshot at path, to be freed by
+ * free_flat_ftree, or NULL (with errno set) if it can't be read or isn't
+ * a valid snapshot saved by ftree_save. Apart from the header, only the
+ * node table is checked, in one pass, so nothing is parsed or copied. The
+ * arrays of the tree are in a private mapping of the file, so changes to
+ * them aren't saved.
+ */
+struct FlatTree *ftree_load(const char *path) {
+    struct snapshot_header header;
+    struct stat info;
+    ssize_t nread = -1;
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return NULL;
+    }
+    if(fstat(fd, &info) != 0 ||
+       (nread = pread(fd, &header, sizeof(header), 0)) == -1 ||
+       nread != sizeof(header) || !check_header(&header, info.st_size)) {
+        int saved_errno = nread == -1 ? errno : EINVAL;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    char *map = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if(map == MAP_FAILED) {
+        errno = saved_errno;
+        return NULL;
+    }
+
+    struct FlatTree *tree = malloc(sizeof(struct FlatTree));
+    if(tree == NULL) {
+        munmap(map, header.size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    tree->nodes = (struct FlatNode *)(map + header.nodes_offset);
+    tree->count = header.count;
+    tree->names = map + header.names_offset;
+    tree->names_len = header.names_len;
+    tree->hashes = map + header.hashes_offset;
+    tree->nhashes = header.nhashes;
+    tree->hash_size = header.hash_size;
+    tree->map = map;
+    tree->map_size = header.size;
+    int valid = check_nodes(tree);
+    if(valid != 1) {
+        free_flat_ftree(tree);
+        errno = valid == 0 ? EINVAL : ENOMEM;
+        return NULL;
+    }
+    return tree;
+}
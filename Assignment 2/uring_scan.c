@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define URING_SCAN
+    #endif
+#endif
+
+#ifdef URING_SCAN
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+    #include <sys/sysmacros.h>
+    #include <linux/io_uring.h>
+    #include <linux/stat.h>
+    // linux/fs.h (from linux/io_uring.h) has its own BLOCK_SIZE.
+    #undef BLOCK_SIZE
+#endif
+
+#include "hash.h"
+#include "uring_scan.h"
+
+#ifdef URING_SCAN
+
+/*
+ * Files are hashed by a small state machine each: statx (only when the
+ * hash cache is used), openat, a chain of reads into the file's own fixed
+ * buffer, then close. Every step is submitted as soon as the one before it
+ * completes, so with many files in progress the ring always has plenty of
+ * operations in flight, and each io_uring_enter both submits all of the
+ * new ones and collects whatever has completed.
+ */
+
+// Size of the buffer each file being hashed is read into.
+#define URING_BUF_SIZE (32 * 1024)
+
+#define URING_MAX_DEPTH 4096
+
+// Set in the user_data of the statx operations of uring_stat_batch, whose
+// low bits are the index of the file in the batch. Otherwise user_data is
+// the index of a slot.
+#define STAT_BATCH_TAG (1ULL << 63)
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_STAT,
+    SLOT_OPEN,
+    SLOT_READ,
+    SLOT_CLOSE
+};
+
+/*
+ * A file being hashed.
+ */
+struct scan_slot {
+    enum slot_state state;
+    const char *path;
+    char *hash_val;
+    int use_cache;
+    int fd;
+    int error;                   // errno of a failed read, reported on close.
+    off_t offset;
+    struct hash_ctx ctx;
+    struct statx stx;
+};
+
+struct uring_scanner {
+    int fd;
+    unsigned depth;              // Files hashed at once.
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned queued;             // Submissions the kernel hasn't taken yet.
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    char *bufs;                  // A buffer of URING_BUF_SIZE for each slot.
+    int fixed;                   // bufs are registered with the kernel.
+    struct scan_slot *slots;
+    unsigned *free_slots;
+    unsigned nfree;
+
+    // State of the uring_stat_batch in progress.
+    struct statx *batch_stx;
+    struct stat *batch_info;
+    int *batch_errors;
+    size_t batch_left;
+};
+
+
+static int ring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_register(int fd, unsigned opcode, void *arg, unsigned n) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+/*
+ * Returns 1 if the kernel behind the ring fd supports every operation the
+ * scanner uses.
+ */
+static int ops_supported(int fd) {
+    static const int ops[] = {IORING_OP_STATX, IORING_OP_OPENAT,
+                              IORING_OP_READ, IORING_OP_READ_FIXED,
+                              IORING_OP_CLOSE};
+    size_t len = sizeof(struct io_uring_probe) +
+                 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    int supported = 0;
+    if(probe != NULL && ring_register(fd, IORING_REGISTER_PROBE, probe,
+                                      256) == 0) {
+        supported = 1;
+        for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            if(ops[i] > probe->last_op ||
+               !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = 0;
+            }
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *info) {
+    memset(info, 0, sizeof(struct stat));
+    info->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    info->st_ino = stx->stx_ino;
+    info->st_mode = stx->stx_mode;
+    info->st_nlink = stx->stx_nlink;
+    info->st_uid = stx->stx_uid;
+    info->st_gid = stx->stx_gid;
+    info->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    info->st_size = stx->stx_size;
+    info->st_blksize = stx->stx_blksize;
+    info->st_blocks = stx->stx_blocks;
+    info->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    info->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    info->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    info->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    info->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    info->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/*
+ * Frees everything scanner holds. The ring mappings are only set once the
+ * ring itself has been set up.
+ */
+static void free_scanner(struct uring_scanner *scanner) {
+    if(scanner->sqes != NULL) {
+        munmap(scanner->sqes, scanner->sqes_size);
+    }
+    if(scanner->cq_ring != NULL && scanner->cq_ring != scanner->sq_ring) {
+        munmap(scanner->cq_ring, scanner->cq_ring_size);
+    }
+    if(scanner->sq_ring != NULL) {
+        munmap(scanner->sq_ring, scanner->sq_ring_size);
+    }
+    if(scanner->fd != -1) {
+        close(scanner->fd);
+    }
+    free(scanner->bufs);
+    free(scanner->slots);
+    free(scanner->free_slots);
+    free(scanner->batch_stx);
+    free(scanner);
+}
+
+/*
+ * Returns a scanner that hashes up to depth files at once, or NULL (with
+ * errno set) if io_uring isn't available or lacks an operation it needs,
+ * in which case the caller should do the same work synchronously.
+ */
+struct uring_scanner *uring_scanner_new(unsigned depth) {
+    struct io_uring_params params;
+    struct uring_scanner *scanner = calloc(1, sizeof(struct uring_scanner));
+    if(scanner == NULL) {
+        return NULL;
+    }
+    depth = depth < 1 ? 1 : depth > URING_MAX_DEPTH ? URING_MAX_DEPTH : depth;
+    scanner->depth = depth;
+
+    // There's room for a full stat batch on top of a full set of files.
+    memset(&params, 0, sizeof(params));
+    scanner->fd = ring_setup(depth * 2, &params);
+    if(scanner->fd == -1 || !ops_supported(scanner->fd)) {
+        if(scanner->fd != -1) {
+            errno = ENOSYS;
+        }
+        int saved_errno = errno;
+        free_scanner(scanner);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    scanner->sq_ring_size = params.sq_off.array +
+                            params.sq_entries * sizeof(unsigned);
+    scanner->cq_ring_size = params.cq_off.cqes +
+                            params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(scanner->cq_ring_size > scanner->sq_ring_size) {
+            scanner->sq_ring_size = scanner->cq_ring_size;
+        }
+        scanner->cq_ring_size = scanner->sq_ring_size;
+    }
+    scanner->sq_ring = mmap(NULL, scanner->sq_ring_size,
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            scanner->fd, IORING_OFF_SQ_RING);
+    if(scanner->sq_ring == MAP_FAILED) {
+        scanner->sq_ring = NULL;
+    }
+    else if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        scanner->cq_ring = scanner->sq_ring;
+    }
+    else {
+        scanner->cq_ring = mmap(NULL, scanner->cq_ring_size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, scanner->fd,
+                                IORING_OFF_CQ_RING);
+        if(scanner->cq_ring == MAP_FAILED) {
+            scanner->cq_ring = NULL;
+        }
+    }
+    scanner->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    scanner->sqes = mmap(NULL, scanner->sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, scanner->fd,
+                         IORING_OFF_SQES);
+    if(scanner->sqes == MAP_FAILED) {
+        scanner->sqes = NULL;
+    }
+
+    scanner->bufs = malloc((size_t)depth * URING_BUF_SIZE);
+    scanner->slots = calloc(depth, sizeof(struct scan_slot));
+    scanner->free_slots = malloc(depth * sizeof(unsigned));
+    scanner->batch_stx = malloc(depth * sizeof(struct statx));
+    if(scanner->sq_ring == NULL || scanner->cq_ring == NULL ||
+       scanner->sqes == NULL || scanner->bufs == NULL ||
+       scanner->slots == NULL || scanner->free_slots == NULL ||
+       scanner->batch_stx == NULL) {
+        free_scanner(scanner);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    char *sq = scanner->sq_ring, *cq = scanner->cq_ring;
+    scanner->sq_head = (unsigned *)(sq + params.sq_off.head);
+    scanner->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    scanner->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    scanner->sq_array = (unsigned *)(sq + params.sq_off.array);
+    scanner->cq_head = (unsigned *)(cq + params.cq_off.head);
+    scanner->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    scanner->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    scanner->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Registering the buffers saves mapping them on every read, but can
+    // fail on the memory lock limit; plain reads into them work anyway.
+    struct iovec *iov = malloc(depth * sizeof(struct iovec));
+    if(iov != NULL) {
+        for(unsigned i = 0; i < depth; i++) {
+            iov[i].iov_base = scanner->bufs + (size_t)i * URING_BUF_SIZE;
+            iov[i].iov_len = URING_BUF_SIZE;
+        }
+        scanner->fixed = ring_register(scanner->fd, IORING_REGISTER_BUFFERS,
+                                       iov, depth) == 0;
+        free(iov);
+    }
+
+    for(unsigned i = 0; i < depth; i++) {
+        scanner->free_slots[i] = depth - 1 - i;
+    }
+    scanner->nfree = depth;
+    return scanner;
+}
+
+/*
+ * Waits for every file queued on scanner to be hashed and frees it.
+ */
+void uring_scanner_free(struct uring_scanner *scanner) {
+    if(scanner == NULL) {
+        return;
+    }
+    uring_hash_wait(scanner);
+    free_scanner(scanner);
+}
+
+/*
+ * Returns a cleared submission queue entry, to be filled in and then
+ * passed to push_sqe.
+ */
+static struct io_uring_sqe *get_sqe(struct uring_scanner *scanner) {
+    unsigned index = *scanner->sq_tail & *scanner->sq_mask;
+    struct io_uring_sqe *sqe = &scanner->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    scanner->sq_array[index] = index;
+    return sqe;
+}
+
+static void push_sqe(struct uring_scanner *scanner) {
+    __atomic_store_n(scanner->sq_tail, *scanner->sq_tail + 1,
+                     __ATOMIC_RELEASE);
+    scanner->queued++;
+}
+
+static void submit_stat(struct uring_scanner *scanner, int dirfd,
+                        const char *name, struct statx *stx,
+                        uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(scanner);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t)name;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uintptr_t)stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = user_data;
+    push_sqe(scanner);
+}
+
+/*
+ * Queues the next operation on the file of slot index, which is in the
+ * state it's been moved to.
+ */
+static void submit_slot(struct uring_scanner *scanner, unsigned index) {
+    struct scan_slot *slot = &scanner->slots[index];
+    if(slot->state == SLOT_STAT) {
+        submit_stat(scanner, AT_FDCWD, slot->path, &slot->stx, index);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(scanner);
+    sqe->user_data = index;
+    if(slot->state == SLOT_OPEN) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)slot->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    }
+    else if(slot->state == SLOT_READ) {
+        sqe->opcode = scanner->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = slot->fd;
+        sqe->addr = (uintptr_t)(scanner->bufs + (size_t)index * URING_BUF_SIZE);
+        sqe->len = URING_BUF_SIZE;
+        sqe->off = slot->offset;
+        sqe->buf_index = index;
+    }
+    else {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = slot->fd;
+    }
+    push_sqe(scanner);
+}
+
+/*
+ * Frees slot index once its file is done with. Files that couldn't be
+ * read get an empty hash, as in generate_ftree.
+ */
+static void finish_slot(struct uring_scanner *scanner, unsigned index,
+                        int error) {
+    struct scan_slot *slot = &scanner->slots[index];
+    if(error != 0) {
+        errno = error;
+        perror("open");
+        memset(slot->hash_val, '\0', BLOCK_SIZE);
+    }
+    slot->state = SLOT_FREE;
+    scanner->free_slots[scanner->nfree++] = index;
+}
+
+/*
+ * Moves the file of slot index on according to the result of the
+ * operation on it that just completed.
+ */
+static void complete_slot(struct uring_scanner *scanner, unsigned index,
+                          int res) {
+    struct scan_slot *slot = &scanner->slots[index];
+    struct stat info;
+
+    switch(slot->state) {
+    case SLOT_STAT:
+        // As in hash_cached, only regular files that could be stat-ed are
+        // looked up in the cache.
+        slot->use_cache = res == 0 && S_ISREG(slot->stx.stx_mode);
+        if(slot->use_cache) {
+            statx_to_stat(&slot->stx, &info);
+            if(hash_cache_get(&info, slot->hash_val)) {
+                finish_slot(scanner, index, 0);
+                return;
+            }
+        }
+        slot->state = SLOT_OPEN;
+        break;
+    case SLOT_OPEN:
+        if(res < 0) {
+            finish_slot(scanner, index, -res);
+            return;
+        }
+        slot->fd = res;
+        slot->offset = 0;
+        slot->error = 0;
+        hash_init(&slot->ctx);
+        slot->state = SLOT_READ;
+        break;
+    case SLOT_READ:
+        if(res > 0) {
+            hash_update(&slot->ctx,
+                        scanner->bufs + (size_t)index * URING_BUF_SIZE, res);
+            slot->offset += res;
+            break;
+        }
+        if(res < 0) {
+            slot->error = -res;
+        }
+        else {
+            hash_final(&slot->ctx, slot->hash_val);
+            if(slot->use_cache) {
+                statx_to_stat(&slot->stx, &info);
+                hash_cache_put(slot->fd, &info, slot->hash_val);
+            }
+        }
+        slot->state = SLOT_CLOSE;
+        break;
+    default:
+        finish_slot(scanner, index, slot->error);
+        return;
+    }
+    submit_slot(scanner, index);
+}
+
+/*
+ * Submits everything queued, waits until at least wait operations have
+ * completed and handles all the completions there are.
+ */
+static void reap(struct uring_scanner *scanner, unsigned wait) {
+    while(scanner->queued > 0 || wait > 0) {
+        long ret = syscall(__NR_io_uring_enter, scanner->fd, scanner->queued,
+                           wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+                           NULL, 0);
+        if(ret >= 0) {
+            scanner->queued -= ret;
+            break;
+        }
+        if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+
+    unsigned head = *scanner->cq_head;
+    while(head != __atomic_load_n(scanner->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = scanner->cqes[head & *scanner->cq_mask];
+        head++;
+        __atomic_store_n(scanner->cq_head, head, __ATOMIC_RELEASE);
+
+        if(cqe.user_data & STAT_BATCH_TAG) {
+            size_t i = cqe.user_data & ~STAT_BATCH_TAG;
+            scanner->batch_errors[i] = cqe.res < 0 ? -cqe.res : 0;
+            if(cqe.res == 0) {
+                statx_to_stat(&scanner->batch_stx[i], &scanner->batch_info[i]);
+            }
+            scanner->batch_left--;
+        }
+        else {
+            complete_slot(scanner, cqe.user_data, cqe.res);
+        }
+    }
+}
+
+/*
+ * lstats the n files names (relative to the directory open on dirfd) all
+ * at once, storing each file's status in info and 0 in errors, or the
+ * errno of the failure in errors.
+ */
+void uring_stat_batch(struct uring_scanner *scanner, int dirfd,
+                      const char **names, size_t n, struct stat *info,
+                      int *errors) {
+    for(size_t start = 0; start < n; start += scanner->depth) {
+        size_t count = n - start < scanner->depth ? n - start :
+                       scanner->depth;
+        scanner->batch_info = info + start;
+        scanner->batch_errors = errors + start;
+        scanner->batch_left = count;
+        for(size_t i = 0; i < count; i++) {
+            submit_stat(scanner, dirfd, names[start + i],
+                        &scanner->batch_stx[i], STAT_BATCH_TAG | i);
+        }
+        while(scanner->batch_left > 0) {
+            reap(scanner, 1);
+        }
+    }
+}
+
+/*
+ * Queues the file path to be hashed into hash_val, through the hash cache
+ * if use_cache is set. It may not be done until uring_hash_wait returns.
+ */
+void uring_hash_file(struct uring_scanner *scanner, const char *path,
+                     char *hash_val, int use_cache) {
+    while(scanner->nfree == 0) {
+        reap(scanner, 1);
+    }
+    unsigned index = scanner->free_slots[--scanner->nfree];
+    struct scan_slot *slot = &scanner->slots[index];
+    slot->path = path;
+    slot->hash_val = hash_val;
+    slot->use_cache = use_cache;
+    slot->state = use_cache ? SLOT_STAT : SLOT_OPEN;
+    submit_slot(scanner, index);
+}
+
+/*
+ * Waits for every file queued with uring_hash_file to be hashed.
+ */
+void uring_hash_wait(struct uring_scanner *scanner) {
+    while(scanner->nfree < scanner->depth) {
+        reap(scanner, 1);
+    }
+}
+
+#else
+
+// Without io_uring there's never a scanner, so only the constructor is
+// ever called.
+
+struct uring_scanner *uring_scanner_new(unsigned depth) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_scanner_free(struct uring_scanner *scanner) {
+}
+
+void uring_stat_batch(struct uring_scanner *scanner, int dirfd,
+                      const char **names, size_t n, struct stat *info,
+                      int *errors) {
+}
+
+void uring_hash_file(struct uring_scanner *scanner, const char *path,
+                     char *hash_val, int use_cache) {
+}
+
+void uring_hash_wait(struct uring_scanner *scanner) {
+}
+
+#endif
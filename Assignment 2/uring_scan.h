@@ -0,0 +1,24 @@
+#ifndef _URING_SCAN_H_
+#define _URING_SCAN_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * An io_uring used by one thread to stat and hash many files at once,
+ * keeping up to its depth of operations in flight instead of blocking on
+ * each one in turn.
+ */
+struct uring_scanner;
+
+// Batched file operations in uring_scan.c
+struct uring_scanner *uring_scanner_new(unsigned depth);
+void uring_scanner_free(struct uring_scanner *scanner);
+void uring_stat_batch(struct uring_scanner *scanner, int dirfd,
+                      const char **names, size_t n, struct stat *info,
+                      int *errors);
+void uring_hash_file(struct uring_scanner *scanner, const char *path,
+                     char *hash_val, int use_cache);
+void uring_hash_wait(struct uring_scanner *scanner);
+
+#endif // _URING_SCAN_H_
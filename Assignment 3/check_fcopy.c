@@ -0,0 +1,203 @@
+/*
+    Checks that fcopy keeps the hard links of the source tree in its copy,
+    and that a copy stays right when links in the source are later broken
+    or made, in each of its modes and on one thread and on several.
+
+    "make check" builds fcopy and this, and runs this from the directory
+    fcopy is in. Each case builds a small source tree in a temporary
+    directory, copies it, changes it, copies it again and compares the
+    files of the copy and which of them are linked with what the case
+    expects. A line is printed for each run that fails, and the exit
+    status is 1 if any did.
+*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Longest contents of a fixture file.
+#define CONTENTS_MAX 64
+
+/*
+    A change to the source tree, and what the copy should hold after it:
+    the contents of d/s/a, d/s/b and d/s/c, and whether a and b are linked.
+*/
+struct check_case {
+    const char *name;
+    void (*change)(void);       // Run from the directory holding s and d.
+    const char *a;
+    const char *b;
+    const char *c;
+    int linked;
+};
+
+static char fcopy[4096];
+
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+static void write_file(const char *path, const char *data) {
+    FILE *f = fopen(path, "w");
+    if(f == NULL || fputs(data, f) == EOF || fclose(f) != 0) {
+        die(path);
+    }
+}
+
+/*
+    Reads the file at path into contents, which has room for CONTENTS_MAX
+    bytes. An unreadable file reads as "(missing)".
+*/
+static void read_file(const char *path, char *contents) {
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        strcpy(contents, "(missing)");
+        return;
+    }
+    size_t len = fread(contents, 1, CONTENTS_MAX - 1, f);
+    contents[len] = '\0';
+    fclose(f);
+}
+
+/*
+    Makes the source tree s in the current directory, where a and b are
+    links to one file and c is a file of its own, and an empty d to copy
+    it into:
+        s/a, s/b    "shared\n"
+        s/c         "c\n"
+*/
+static void make_fixture(void) {
+    if(system("rm -rf s d") != 0) {
+        die("rm");
+    }
+    if(mkdir("s", 0755) != 0 || mkdir("d", 0755) != 0) {
+        die("mkdir");
+    }
+    write_file("s/a", "shared\n");
+    if(link("s/a", "s/b") != 0) {
+        die("link");
+    }
+    write_file("s/c", "c\n");
+}
+
+/*
+    Copies s into d with fcopy, passing it args. Returns 0 on success.
+*/
+static int run(const char *args) {
+    char cmd[8192];
+    snprintf(cmd, sizeof(cmd), "'%s' %s s d >/dev/null 2>&1", fcopy, args);
+    return system(cmd);
+}
+
+
+static void unchanged(void) {
+}
+
+/*
+    Replaces b with a file of its own, leaving a as it was.
+*/
+static void break_link(void) {
+    if(unlink("s/b") != 0) {
+        die("unlink");
+    }
+    write_file("s/b", "b on its own\n");
+}
+
+/*
+    Breaks the link in the source, then damages the copy the way fcopy
+    used to on a re-sync, writing b's new contents through its link to a.
+*/
+static void break_link_damaged(void) {
+    break_link();
+    write_file("d/s/a", "b on its own\n");
+}
+
+/*
+    Links c to a, so that all three are one file.
+*/
+static void make_link(void) {
+    if(unlink("s/c") != 0 || link("s/a", "s/c") != 0) {
+        die("link");
+    }
+}
+
+static void change_shared(void) {
+    write_file("s/a", "changed in place\n");
+}
+
+static const struct check_case cases[] = {
+    {"unchanged", unchanged, "shared\n", "shared\n", "c\n", 1},
+    {"broken link", break_link, "shared\n", "b on its own\n", "c\n", 0},
+    {"broken link, damaged copy", break_link_damaged, "shared\n",
+     "b on its own\n", "c\n", 0},
+    {"new link", make_link, "shared\n", "shared\n", "shared\n", 1},
+    {"shared contents", change_shared, "changed in place\n",
+     "changed in place\n", "c\n", 1},
+};
+
+
+int main(int argc, char **argv) {
+    if(realpath("fcopy", fcopy) == NULL) {
+        die("fcopy");
+    }
+    char dir[] = "/tmp/check_fcopy.XXXXXX";
+    if(mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        die("mkdtemp");
+    }
+
+    // Each case is re-synced in each mode, on one thread and on four.
+    const char *modes[] = {"", "--checksum "};
+    const int threads[] = {1, 4};
+    int runs = 0, failures = 0;
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        for(int m = 0; m < 2; m++) {
+            for(int t = 0; t < 2; t++) {
+                char args[256];
+                make_fixture();
+                snprintf(args, sizeof(args), "%s-j %d", modes[m], threads[t]);
+                int ret = run(args);
+                cases[i].change();
+                if(ret == 0) {
+                    ret = run(args);
+                }
+
+                char a[CONTENTS_MAX], b[CONTENTS_MAX], c[CONTENTS_MAX];
+                struct stat a_info, b_info;
+                read_file("d/s/a", a);
+                read_file("d/s/b", b);
+                read_file("d/s/c", c);
+                int linked = stat("d/s/a", &a_info) == 0 &&
+                             stat("d/s/b", &b_info) == 0 &&
+                             a_info.st_ino == b_info.st_ino;
+                runs++;
+                if(ret != 0 || strcmp(a, cases[i].a) != 0 ||
+                   strcmp(b, cases[i].b) != 0 || strcmp(c, cases[i].c) != 0 ||
+                   linked != cases[i].linked) {
+                    failures++;
+                    printf("FAIL %s (%s)\nexpected: a %sb %sc %s%s\n"
+                           "got: a %sb %sc %s%s\n", cases[i].name, args,
+                           cases[i].a, cases[i].b, cases[i].c,
+                           cases[i].linked ? "linked" : "not linked",
+                           a, b, c, linked ? "linked" : "not linked");
+                }
+            }
+        }
+    }
+
+    if(chdir("/") != 0) {
+        die("chdir");
+    }
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+    if(system(cmd) != 0) {
+        perror("rm");
+    }
+    printf("%d of %d checks passed\n", runs - failures, runs);
+    return failures > 0;
+}
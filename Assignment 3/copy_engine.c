@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include "copy_engine.h"
+
+// Only FICLONE is wanted from linux/fs.h, not its BLOCK_SIZE.
+#undef BLOCK_SIZE
+#include "hash.h"
+
+// Size of the buffer of the read/write fallback.
+#define COPY_RW_BUF_SIZE (1024 * 1024)
+
+// Most that's asked of copy_file_range or sendfile at once.
+#define COPY_CHUNK (1L << 30)
+
+// Pairs of file systems whose best method is remembered.
+#define COPY_ROUTES 64
+
+/*
+    The first method worth trying for copies from the file system src to
+    the file system dest. A method that turns out not to be supported
+    between them is skipped from then on, so it only fails once.
+*/
+struct copy_route {
+    dev_t src;
+    dev_t dest;
+    int method;
+};
+
+static struct copy_route routes[COPY_ROUTES];
+static int nroutes = 0;
+static pthread_mutex_t routes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+    Returns the first method to try for copies from src to dest.
+*/
+static int route_method(dev_t src, dev_t dest) {
+    int method = COPY_CLONE;
+    pthread_mutex_lock(&routes_lock);
+    for(int i = 0; i < nroutes; i++) {
+        if(routes[i].src == src && routes[i].dest == dest) {
+            method = routes[i].method;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&routes_lock);
+    return method;
+}
+
+/*
+    Records that copies from src to dest should start at method (or a
+    later one). Once the table is full, pairs it doesn't have just keep
+    trying every method.
+*/
+static void skip_to_method(dev_t src, dev_t dest, int method) {
+    pthread_mutex_lock(&routes_lock);
+    int i = 0;
+    while(i < nroutes && (routes[i].src != src || routes[i].dest != dest)) {
+        i++;
+    }
+    if(i < nroutes) {
+        if(routes[i].method < method) {
+            routes[i].method = method;
+        }
+    }
+    else if(nroutes < COPY_ROUTES) {
+        routes[nroutes].src = src;
+        routes[nroutes].dest = dest;
+        routes[nroutes].method = method;
+        nroutes++;
+    }
+    pthread_mutex_unlock(&routes_lock);
+}
+
+/*
+    Returns 1 if err means a method can't be used between two files at
+    all, rather than that something went wrong while using it.
+*/
+static int unsupported(int err) {
+    return err == EOPNOTSUPP || err == ENOTSUP || err == ENOTTY ||
+           err == EXDEV || err == EINVAL || err == ENOSYS || err == EPERM;
+}
+
+/*
+    Copies what src has from *pos to end to the same place in dest with
+    method, which mustn't be COPY_CLONE, advancing *pos past what was
+    copied. An end of -1 copies to the end of src, however big it is, but
+    only by reading and writing. Returns 0 once it reaches end or runs out
+    of data (which for the kernel methods might be short of the end of src)
+    and -1 (with errno set) on error.
+*/
+static int copy_with(int method, int src_fd, int dest_fd, off_t *pos,
+                     off_t end) {
+    if(method == COPY_RANGE) {
+        while(*pos < end) {
+            loff_t in = *pos, out = *pos;
+            size_t len = end - *pos < COPY_CHUNK ? end - *pos : COPY_CHUNK;
+            ssize_t n = copy_file_range(src_fd, &in, dest_fd, &out, len, 0);
+            if(n == -1 && errno == EINTR) {
+                continue;
+            }
+            if(n <= 0) {
+                return n;
+            }
+            *pos += n;
+        }
+        return 0;
+    }
+    if(method == COPY_SENDFILE) {
+        // sendfile writes at the file position of dest.
+        if(lseek(dest_fd, *pos, SEEK_SET) == -1) {
+            return -1;
+        }
+        while(*pos < end) {
+            size_t len = end - *pos < COPY_CHUNK ? end - *pos : COPY_CHUNK;
+            ssize_t n = sendfile(dest_fd, src_fd, pos, len);
+            if(n == -1 && errno == EINTR) {
+                continue;
+            }
+            if(n <= 0) {
+                return n;
+            }
+        }
+        return 0;
+    }
+
+    char *buf = malloc(COPY_RW_BUF_SIZE);
+    if(buf == NULL) {
+        return -1;
+    }
+    int ret = 0;
+    while(end == -1 || *pos < end) {
+        size_t len = COPY_RW_BUF_SIZE;
+        if(end != -1 && end - *pos < COPY_RW_BUF_SIZE) {
+            len = end - *pos;
+        }
+        ssize_t n = pread(src_fd, buf, len, *pos);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0 || pwrite_all(dest_fd, buf, n, *pos) != 0) {
+            ret = n == 0 ? 0 : -1;
+            break;
+        }
+        *pos += n;
+    }
+    free(buf);
+    return ret;
+}
+
+/*
+    Copies bytes *pos to end of src (whose status is src_info) to the same
+    place in dest (whose status is dest_info), starting with method and
+    carrying on with the next one from wherever a method stops short.
+    Advances *pos past what was copied, which is short of end only if src
+    shrank. Returns the method that copied the last of the data, or -1
+    (with errno set) on error.
+*/
+static int copy_run(int method, int src_fd, int dest_fd, off_t *pos,
+                    off_t end, const struct stat *src_info,
+                    const struct stat *dest_info) {
+    // Only whole files can be cloned.
+    if(method == COPY_CLONE) {
+        method = COPY_RANGE;
+    }
+    for(; method < COPY_READ_WRITE; method++) {
+        off_t start = *pos;
+        int ret = copy_with(method, src_fd, dest_fd, pos, end);
+        if(ret == 0 && *pos >= end) {
+            return method;
+        }
+        if(ret == -1 && !unsupported(errno)) {
+            return -1;
+        }
+        // Never use a method again between file systems it didn't work
+        // between at all.
+        if(ret == -1 && *pos == start) {
+            skip_to_method(src_info->st_dev, dest_info->st_dev, method + 1);
+        }
+    }
+    return copy_with(COPY_READ_WRITE, src_fd, dest_fd, pos, end) == 0 ?
+           COPY_READ_WRITE : -1;
+}
+
+
+/*
+    Copies the contents of the regular file open on src_fd into the empty
+    file open on dest_fd (which must be open for writing), without the
+    data passing through this process if the file systems allow it: the
+    file is cloned if they can share blocks, or else copied inside the
+    kernel with copy_file_range or sendfile, and only as a last resort read
+    and written through a buffer. If a method stops short of the end of
+    src, the next one carries on from there. Which methods work is
+    remembered per pair of file systems.
+    Only the runs of data of a file with holes are copied, so the copy has
+    holes in the same places, and copying it costs about as much as its
+    allocated size rather than its apparent size.
+    Returns the method that copied the last of the data, or -1 (with errno
+    set) on error.
+*/
+int copy_data(int src_fd, int dest_fd) {
+    struct stat src_info, dest_info;
+    if(fstat(src_fd, &src_info) != 0 || fstat(dest_fd, &dest_info) != 0) {
+        return -1;
+    }
+
+    // Files that say they're empty (like those in /proc) might not be, so
+    // they're just read.
+    off_t pos = 0;
+    if(src_info.st_size == 0) {
+        return copy_with(COPY_READ_WRITE, src_fd, dest_fd, &pos, -1) == 0 ?
+               COPY_READ_WRITE : -1;
+    }
+
+    // A clone shares the whole file, holes and all, so it comes first.
+    int method = route_method(src_info.st_dev, dest_info.st_dev);
+    if(method == COPY_CLONE) {
+        if(ioctl(dest_fd, FICLONE, src_fd) == 0) {
+            return COPY_CLONE;
+        }
+        if(!unsupported(errno)) {
+            return -1;
+        }
+        skip_to_method(src_info.st_dev, dest_info.st_dev, COPY_RANGE);
+    }
+
+    int sparse = may_have_holes(&src_info);
+    while(pos < src_info.st_size) {
+        off_t end = sparse ? data_run(src_fd, &pos, src_info.st_size) :
+                             src_info.st_size;
+        if(pos == end) {
+            break; // Nothing but a hole left.
+        }
+        method = copy_run(route_method(src_info.st_dev, dest_info.st_dev),
+                          src_fd, dest_fd, &pos, end, &src_info, &dest_info);
+        if(method == -1 || pos < end) {
+            return method;
+        }
+    }
+    // Writing the runs left holes between them, but a hole at the end of
+    // src still needs dest to be made as long.
+    if(sparse && ftruncate(dest_fd, src_info.st_size) != 0) {
+        return -1;
+    }
+    return method;
+}
+
+/*
+    Makes bytes start to end of the file open on fd, which is size bytes
+    long, read as zeros by punching a hole there, unless it's a hole
+    already. The file keeps its size. Returns 1 if fd was changed, 0 if it
+    wasn't and -1 (with errno set) if the hole couldn't be punched, in
+    which case the zeros have to be written.
+*/
+int punch_hole(int fd, off_t start, off_t end, off_t size) {
+    if(end > size) {
+        end = size;
+    }
+    if(start >= end) {
+        return 0;
+    }
+    off_t data = lseek(fd, start, SEEK_DATA);
+    if((data == -1 && errno == ENXIO) || (data != -1 && data >= end)) {
+        return 0;
+    }
+    if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start,
+                 end - start) != 0) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+    Writes all len bytes of buf to fd at offset, retrying short writes.
+    Returns 0 on success and -1 on error.
+*/
+int pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+    while(len > 0) {
+        ssize_t written = pwrite(fd, buf, len, offset);
+        if(written == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+        offset += written;
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _COPY_ENGINE_H_
+#define _COPY_ENGINE_H_
+
+#include <sys/types.h>
+
+/*
+ * Ways copy_data can move the contents of a file, fastest first. Each one
+ * needs less from the file systems involved than the one before it.
+ */
+#define COPY_CLONE 0             // Share the blocks with ioctl(FICLONE).
+#define COPY_RANGE 1             // copy_file_range, inside the kernel.
+#define COPY_SENDFILE 2          // sendfile, inside the kernel.
+#define COPY_READ_WRITE 3        // read and write through a buffer.
+
+// File copying functions in copy_engine.c
+int copy_data(int src_fd, int dest_fd);
+int pwrite_all(int fd, const char *buf, size_t len, off_t offset);
+int punch_hole(int fd, off_t start, off_t end, off_t size);
+
+#endif // _COPY_ENGINE_H_
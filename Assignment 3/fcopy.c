@@ -1,22 +1,68 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
 #include "ftree.h"
 
 
+/*
+    Returns the number of threads given to -j as arg, or -1 if it isn't a
+    whole number from 0 (one per CPU) up.
+*/
+static int parse_threads(const char *arg) {
+    char *end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    if(errno != 0 || end == arg || *end != '\0' || n < 0 || n > INT_MAX) {
+        return -1;
+    }
+    return n;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        printf("Usage:\n\tfcopy SRC DEST\n");
+    static const struct option long_opts[] = {
+        {"quick", no_argument, NULL, 'q'},
+        {"checksum", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    int threads = 0;
+    int flags = 0;
+    int opt;
+    while((opt = getopt_long(argc, argv, "j:", long_opts, NULL)) != -1) {
+        switch(opt) {
+        case 'j':
+            threads = parse_threads(optarg);
+            if(threads < 0) {
+                fprintf(stderr, "fcopy: bad number of threads: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'q':
+            flags &= ~COPY_CHECKSUM;
+            break;
+        case 'c':
+            flags |= COPY_CHECKSUM;
+            break;
+        default:
+            threads = -1;
+        }
+    }
+    if (argc - optind != 2 || threads < 0) {
+        printf("Usage:\n\tfcopy [-j THREADS] [--quick | --checksum] SRC DEST\n");
         return 0;
     }
 
-    int ret = copy_ftree(argv[1], argv[2]);
+    int ret = copy_ftree_parallel(argv[optind], argv[optind + 1], threads,
+                                  flags);
     if (ret < 0) {
         printf("Errors encountered during copy\n");
         ret = -ret;
     } else {
         printf("Copy completed successfully\n");
     }
-    printf("%d processes used\n", ret);
-    
+    printf("%d threads used\n", ret);
+
     return 0;
 }
-
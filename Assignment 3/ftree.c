@@ -2,29 +2,557 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/mman.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "ftree.h"
 #include "hash.h"
+#include "dir_reader.h"
+#include "copy_engine.h"
 
-int copy_file(const char *src, const char *dest, mode_t perm, off_t size);
+// Size of the chunks files are copied and compared in.
+#define COPY_BUF_SIZE (64 * 1024)
+
+// Amount of each file mapped at once when comparing files.
+#define COPY_MAP_WINDOW (64 * 1024 * 1024)
+
+// Most threads copy_ftree_parallel will start.
+#define MAX_THREADS 256
+
+int copy_file(const char *src, const char *dest, const struct stat *info,
+              int flags);
+int keep_file(const char *path, const struct stat *info, mode_t perm);
+int set_mtime(const char *path, const struct stat *src_info);
+int same_mtime(const struct stat *a, const struct stat *b);
+int update_file(int src_fd, off_t size, int dest_fd, char *hash_val);
+int update_range(int src_fd, int dest_fd, off_t dest_size, off_t start,
+                 off_t end, struct hash_ctx *ctx);
+int cached_match(const struct stat *src_info, const struct stat *dest_info);
+int link_file(const char *target, const char *path);
+void cache_copy(int src_fd, const struct stat *src_info, const char *dest,
+                const char *hash_val);
 char *get_path(const char *part1, const char *part2, int len);
 char *get_name(const char* path);
 
 /*
-    Copies over the file tree rooted at src into the directory 'dest'.
+    A directory being copied. Its copy is only given the permissions of the
+    directory in src once everything in it has been copied, since they
+    might not allow anything to be written into it.
+*/
+struct copy_dir {
+    char *path;                  // Path of the copy.
+    mode_t mode;                 // Permissions of the directory in src.
+    long pending;                // Tasks in it not done yet, plus one
+                                 // while it's being read.
+    struct copy_dir *parent;     // NULL for the top directory.
+};
+
+/*
+    A directory or regular file waiting to be copied into the directory
+    dest.
+*/
+struct copy_task {
+    char *src;
+    const char *dest;
+    struct copy_dir *parent;     // The copy_dir of dest, NULL at the top.
+    struct stat info;            // Status of src from its directory.
+};
+
+/*
+    A regular file with several hard links in src, found under the first
+    of them to be copied. Its other links are made links to that copy
+    (once it's done) instead of copies of their own.
+*/
+struct link_entry {
+    dev_t dev;
+    ino_t ino;
+    char *path;                  // Path of its first copy in dest.
+    int state;                   // One of the LINK_* states below.
+    struct link_entry *next;     // In the same bucket.
+};
+
+// States of a link_entry.
+#define LINK_COPYING 0           // The first link is being copied.
+#define LINK_DONE 1              // It was copied, so can be linked to.
+#define LINK_FAILED 2            // It wasn't, so copy the others too.
+
+struct copier;
+
+/*
+    State of one thread of the pool. Tasks it finds are pushed onto the
+    back of its deque and popped from the back again, so each thread works
+    depth first; idle threads steal from the front, which holds the tasks
+    nearest the top of the tree and so (usually) the most work.
+*/
+struct copy_worker {
+    pthread_mutex_t lock;        // Protects the deque.
+    struct copy_task *tasks;
+    size_t head;                 // Index of the oldest task.
+    size_t tail;                 // Index just past the newest task.
+    size_t cap;
+    struct copier *copier;
+    unsigned int seed;           // For picking threads to steal from.
+    pthread_t tid;
+};
+
+/*
+    State shared by the threads copying one tree.
+*/
+struct copier {
+    struct copy_worker *workers;
+    int nworkers;
+    long queued;                 // Tasks waiting in some deque.
+    long pending;                // Tasks queued or being worked on.
+    long errors;                 // Files and directories that failed.
+    int flags;                   // COPY_* flags.
+    int idle;                    // Threads waiting for a task.
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+
+    struct link_entry **links;   // Hash table of the files with several
+    size_t links_cap;            // hard links that have been met.
+    size_t nlinks;
+    pthread_mutex_t links_lock;  // Protects the table and its entries,
+    pthread_cond_t links_cond;   // whose copies may be waited for.
+};
+
+
+/*
+    Queues task on the deque of self.
+*/
+static void push_task(struct copy_worker *self, const struct copy_task *task) {
+    struct copier *copier = self->copier;
+    // Count the task before anyone can take it, so that neither count can
+    // drop below the real number.
+    __atomic_add_fetch(&copier->pending, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&copier->queued, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&self->lock);
+    if(self->tail == self->cap) {
+        // Slide the tasks down to the front, or grow the deque.
+        if(self->head > self->cap / 2) {
+            memmove(self->tasks, self->tasks + self->head,
+                    (self->tail - self->head) * sizeof(struct copy_task));
+        }
+        else {
+            self->cap = self->cap == 0 ? 256 : self->cap * 2;
+            self->tasks = realloc(self->tasks,
+                                  self->cap * sizeof(struct copy_task));
+            if(self->tasks == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            memmove(self->tasks, self->tasks + self->head,
+                    (self->tail - self->head) * sizeof(struct copy_task));
+        }
+        self->tail -= self->head;
+        self->head = 0;
+    }
+    self->tasks[self->tail++] = *task;
+    pthread_mutex_unlock(&self->lock);
+
+    if(__atomic_load_n(&copier->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&copier->idle_lock);
+        pthread_cond_signal(&copier->idle_cond);
+        pthread_mutex_unlock(&copier->idle_lock);
+    }
+}
+
+/*
+    Takes a task from the back (own == 1) or the front (own == 0) of the
+    deque of worker. Returns 1 if there was one.
+*/
+static int take_task(struct copy_worker *worker, int own,
+                     struct copy_task *task) {
+    int found = 0;
+    pthread_mutex_lock(&worker->lock);
+    if(worker->head < worker->tail) {
+        if(own) {
+            *task = worker->tasks[--worker->tail];
+        }
+        else {
+            *task = worker->tasks[worker->head++];
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    if(found) {
+        __atomic_sub_fetch(&worker->copier->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    return found;
+}
+
+/*
+    Finds the next task for self: its own newest one, or else the oldest
+    one of another thread. Waits while other threads are busy and might
+    still find more. Returns 0 once everything has been copied.
+*/
+static int next_task(struct copy_worker *self, struct copy_task *task) {
+    struct copier *copier = self->copier;
+    while(1) {
+        if(take_task(self, 1, task)) {
+            return 1;
+        }
+        int start = rand_r(&self->seed) % copier->nworkers;
+        for(int i = 0; i < copier->nworkers; i++) {
+            struct copy_worker *victim =
+                &copier->workers[(start + i) % copier->nworkers];
+            if(victim != self && take_task(victim, 0, task)) {
+                return 1;
+            }
+        }
+
+        pthread_mutex_lock(&copier->idle_lock);
+        __atomic_add_fetch(&copier->idle, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&copier->queued, __ATOMIC_SEQ_CST) == 0 &&
+              __atomic_load_n(&copier->pending, __ATOMIC_SEQ_CST) > 0) {
+            pthread_cond_wait(&copier->idle_cond, &copier->idle_lock);
+        }
+        __atomic_sub_fetch(&copier->idle, 1, __ATOMIC_SEQ_CST);
+        int done = __atomic_load_n(&copier->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&copier->idle_lock);
+        if(done) {
+            return 0;
+        }
+    }
+}
+
+static void finish_task(struct copy_worker *self) {
+    struct copier *copier = self->copier;
+    if(__atomic_sub_fetch(&copier->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&copier->idle_lock);
+        pthread_cond_broadcast(&copier->idle_cond);
+        pthread_mutex_unlock(&copier->idle_lock);
+    }
+}
+
+static void count_error(struct copier *copier) {
+    __atomic_add_fetch(&copier->errors, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+    Marks one task in dir as done. The last one gives the copy of dir its
+    permissions, which in turn counts as a task done in its parent.
+*/
+static void dir_done(struct copier *copier, struct copy_dir *dir) {
+    while(dir != NULL &&
+          __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        // Change permissions of the copied directory to that of the
+        // directory in src.
+        if (chmod(dir->path, dir->mode) != 0) {
+            perror("Directory permissions couldn't be changed");
+            count_error(copier);
+        }
+        struct copy_dir *parent = dir->parent;
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+/*
+    Copies the directory task->src into task->dest: creates the copy and
+    queues a task for each directory and regular file in it.
+*/
+static void copy_dir_task(struct copy_worker *self, struct copy_task *task) {
+    struct copier *copier = self->copier;
+    struct dir_entry entry;
+    struct stat src_item_info;
+
+    char *src_name = get_name(task->src); // Get the name of the directory.
+    int dir_path_len = strlen(task->dest) + strlen(src_name) + 2;
+    char *dir_path = get_path(task->dest, src_name, dir_path_len);
+    free(src_name);
+
+    DIR *dest_dir = opendir(dir_path);
+    if(dest_dir == NULL) {
+        int failed = 0;
+        if(ENOTDIR == errno) { // return error if the types don't match.
+            printf("Type mismatch.\n");
+            failed = 1;
+        }
+        // Create the directory if it doesn't exist.
+        else if (ENOENT == errno) {
+            if(mkdir(dir_path, 00777) != 0) {
+                perror("Failed to create directory");
+                failed = 1;
+            }
+        }
+        // Modify permissions if dir doesn't have valid permissions.
+        else if (EACCES == errno) {
+            chmod(dir_path, 00777);
+        }
+        else { // return error if opendir failed for any other reason.
+            perror("opendir");
+            failed = 1;
+        }
+        if(failed) {
+            count_error(copier);
+            free(dir_path);
+            dir_done(copier, task->parent);
+            return;
+        }
+    }
+    else {
+        chmod(dir_path, 00777);
+        closedir(dest_dir);
+    }
+
+    struct dir_reader *src_dir = dir_open(AT_FDCWD, task->src);
+    if(src_dir == NULL) {
+        perror("source dir");
+        if(chmod(dir_path, task->info.st_mode) != 0){
+            perror("Directory permissions couldn't be set");
+        }
+        count_error(copier);
+        free(dir_path);
+        dir_done(copier, task->parent);
+        return;
+    }
+
+    struct copy_dir *dir = malloc(sizeof(struct copy_dir));
+    if(dir == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    dir->path = dir_path;
+    dir->mode = task->info.st_mode;
+    dir->pending = 1;
+    dir->parent = task->parent;
+
+    /*
+        Iterate over the directory 'src' and queue valid items in 'src' to
+        be copied over to the directory in 'dest'. The type of each item
+        comes with the directory entry on most file systems, so items that
+        aren't copied (links and special files) don't need an lstat.
+    */
+    int ret;
+    while((ret = dir_next(src_dir, &entry)) == 1) {
+        if(entry.name[0] == '.') {
+            continue;
+        }
+        src_item_info.st_mode = entry.type;
+        src_item_info.st_size = 0;
+        if((entry.type == 0 || S_ISREG(entry.type) ||
+            S_ISDIR(entry.type)) &&
+           fstatat(dir_fd(src_dir), entry.name, &src_item_info,
+                   AT_SYMLINK_NOFOLLOW) != 0) {
+            perror("lstat");
+            count_error(copier);
+            continue;
+        }
+        if(!S_ISDIR(src_item_info.st_mode) &&
+           !S_ISREG(src_item_info.st_mode)) {
+            continue;
+        }
+
+        int src_item_len = strlen(task->src) + strlen(entry.name) + 2;
+        struct copy_task item;
+        item.src = get_path(task->src, entry.name, src_item_len);
+        item.dest = dir->path;
+        item.parent = dir;
+        item.info = src_item_info;
+        __atomic_add_fetch(&dir->pending, 1, __ATOMIC_SEQ_CST);
+        push_task(self, &item);
+    }
+    if(ret == -1) {
+        perror("readdir");
+        count_error(copier);
+    }
+    dir_close(src_dir);
+
+    // Done reading it, though what's in it may still be being copied.
+    dir_done(copier, dir);
+}
+
+static size_t link_bucket(dev_t dev, ino_t ino, size_t cap) {
+    return ((uint64_t)dev * 0x9e3779b97f4a7c15ULL ^ ino) & (cap - 1);
+}
+
+/*
+    Returns the entry of copier's link table for the file dev, ino, or
+    NULL. Must be called with links_lock held.
+*/
+static struct link_entry *find_link(struct copier *copier, dev_t dev,
+                                    ino_t ino) {
+    if(copier->links_cap == 0) {
+        return NULL;
+    }
+    struct link_entry *entry =
+        copier->links[link_bucket(dev, ino, copier->links_cap)];
+    while(entry != NULL && (entry->dev != dev || entry->ino != ino)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+/*
+    Adds an entry for the file dev, ino, whose first copy is being made at
+    path, to copier's link table, growing it as needed. Must be called with
+    links_lock held. Returns the new entry.
+*/
+static struct link_entry *add_link(struct copier *copier, dev_t dev,
+                                   ino_t ino, char *path) {
+    if(copier->nlinks >= copier->links_cap) {
+        size_t cap = copier->links_cap == 0 ? 1024 : copier->links_cap * 2;
+        struct link_entry **links = calloc(cap, sizeof(struct link_entry *));
+        if(links == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for(size_t i = 0; i < copier->links_cap; i++) {
+            while(copier->links[i] != NULL) {
+                struct link_entry *entry = copier->links[i];
+                copier->links[i] = entry->next;
+                size_t bucket = link_bucket(entry->dev, entry->ino, cap);
+                entry->next = links[bucket];
+                links[bucket] = entry;
+            }
+        }
+        free(copier->links);
+        copier->links = links;
+        copier->links_cap = cap;
+    }
+    struct link_entry *entry = malloc(sizeof(struct link_entry));
+    if(entry == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t bucket = link_bucket(dev, ino, copier->links_cap);
+    entry->dev = dev;
+    entry->ino = ino;
+    entry->path = path;
+    entry->state = LINK_COPYING;
+    entry->next = copier->links[bucket];
+    copier->links[bucket] = entry;
+    copier->nlinks++;
+    return entry;
+}
+
+/*
+    Makes path a hard link to the file target, replacing whatever regular
+    file is at path unless it's a link to target already. Returns 0 on
+    success, 1 if the file system can't link them (so the file should be
+    copied instead) and -1 on error.
+*/
+int link_file(const char *target, const char *path) {
+    struct stat info, target_info;
+    if(lstat(path, &info) == 0) {
+        if(S_ISDIR(info.st_mode)) { // Return error if the types don't match.
+            printf("Type mismatch.\n");
+            return -1;
+        }
+        if(lstat(target, &target_info) == 0 &&
+           info.st_dev == target_info.st_dev &&
+           info.st_ino == target_info.st_ino) {
+            return 0;
+        }
+        if(unlink(path) != 0) {
+            perror("unlink - file in dest");
+            return -1;
+        }
+    }
+    if(link(target, path) != 0) {
+        if(errno == EMLINK || errno == EPERM || errno == EOPNOTSUPP ||
+           errno == EXDEV) {
+            return 1;
+        }
+        perror("link");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Copies the regular file of task into its directory in dest, like
+    copy_file, except that a file with several hard links is only copied
+    the first time one of them is met. The others become hard links to
+    that copy, made once it's done (waiting for it if need be). Returns
+    -1 on error.
+*/
+static int copy_task_file(struct copier *copier, struct copy_task *task) {
+    if(task->info.st_nlink < 2) {
+        return copy_file(task->src, task->dest, &task->info, copier->flags);
+    }
+    char *src_name = get_name(task->src);
+    int path_len = strlen(task->dest) + strlen(src_name) + 2;
+    char *path = get_path(task->dest, src_name, path_len);
+    free(src_name);
+
+    pthread_mutex_lock(&copier->links_lock);
+    struct link_entry *entry = find_link(copier, task->info.st_dev, task->info.st_ino);
+    if(entry == NULL) {
+        // This is the first link, so copy it for the others to link to.
+        entry = add_link(copier, task->info.st_dev, task->info.st_ino,
+                         path);
+        pthread_mutex_unlock(&copier->links_lock);
+        int ret = copy_file(task->src, task->dest, &task->info,
+                            copier->flags);
+        pthread_mutex_lock(&copier->links_lock);
+        entry->state = ret == -1 ? LINK_FAILED : LINK_DONE;
+        pthread_cond_broadcast(&copier->links_cond);
+        pthread_mutex_unlock(&copier->links_lock);
+        return ret;
+    }
+    while(entry->state == LINK_COPYING) {
+        pthread_cond_wait(&copier->links_cond, &copier->links_lock);
+    }
+    int state = entry->state;
+    pthread_mutex_unlock(&copier->links_lock);
+
+    int ret = state == LINK_DONE ? link_file(entry->path, path) : 1;
+    free(path);
+    if(ret == 1) {
+        ret = copy_file(task->src, task->dest, &task->info, copier->flags);
+    }
+    return ret;
+}
+
+static void *worker_main(void *arg) {
+    struct copy_worker *self = arg;
+    struct copy_task task;
+    while(next_task(self, &task)) {
+        if(S_ISDIR(task.info.st_mode)) {
+            copy_dir_task(self, &task);
+        }
+        else {
+            if(copy_task_file(self->copier, &task) == -1) {
+                count_error(self->copier);
+            }
+            dir_done(self->copier, task.parent);
+        }
+        free(task.src);
+        finish_task(self);
+    }
+    return NULL;
+}
+
+
+/*
+    Copies over the file tree rooted at src into the directory 'dest', on
+    one thread per online CPU.
+*/
+int copy_ftree(const char *src, const char *dest) {
+    return copy_ftree_parallel(src, dest, 0, 0);
+}
+
+/*
+    Copies over the file tree rooted at src into the directory 'dest' on a
+    pool of 'threads' threads (one per online CPU if threads is 0), which
+    copy directories and regular files alike as they find them. Files
+    already in dest are brought up to date as flags says (see COPY_*).
 
     Does not copy over regular files in the file tree rooted at 'src' that
     don't have valid permissions.
 */
-int copy_ftree(const char *src, const char *dest) {
-    struct stat src_info, dest_info, src_item_info;
-    struct dirent *dp;
-    char processes = 1;
-    int num_children = 0;
-    int flag = 0;
+int copy_ftree_parallel(const char *src, const char *dest, int threads,
+                        int flags) {
+    struct stat src_info, dest_info;
 
     if ((lstat(src, &src_info) != 0) || (lstat(dest, &dest_info) != 0)) {
         perror("lstat");
@@ -41,253 +569,481 @@ int copy_ftree(const char *src, const char *dest) {
         perror("dest");
         return -1;
     }
+    closedir(destp);
 
     // Copy the file 'src' into dest.
     if(S_ISREG(src_info.st_mode)) {
-         flag += copy_file(src, dest, src_info.st_mode, src_info.st_size);
-         if(flag == -1 && processes > 0) {
-             processes = -processes;
-         }
+        return copy_file(src, dest, &src_info, flags) == -1 ? -1 : 1;
+    }
+    else if(!S_ISDIR(src_info.st_mode)) {
+        return 1;
     }
 
     // Copy the directory 'src' into dest.
-    else if (S_ISDIR(src_info.st_mode)) {
-
-        char *src_name = get_name(src); // Get the name of the directory.
-        int dir_path_len = strlen(dest) + strlen(src_name) + 2;
-        char *dir_path = get_path(dest, src_name, dir_path_len);
-        free(src_name);
-
-        DIR *dest_dir = opendir(dir_path);
-        if(dest_dir == NULL) {
-            if(ENOENT == errno || ENOTDIR == errno || EACCES == errno) {
-                if(ENOTDIR == errno) { // return error if the types don't match.
-                    printf("Type mismatch.\n");
-                    free(dir_path);
-                    return -1;
-                }
-                // Create the directory if it doesn't exist.
-                else if (ENOENT == errno) {
-                    if(mkdir(dir_path, 00777) != 0) {
-                        perror("Failed to create directory");
-                        return -1;
-                    }
-                }
-                // Modify permissions if dir doesn't have valid permissions.
-                else {
-                    chmod(dir_path, 00777);
-                }
-            }
-            else { // return error if opendir failed for any other reason.
-                perror("opendir");
-                return -1;
-            }
-        }
-        else {
-            chmod(dir_path, 00777);
-            closedir(dest_dir);
-        }
-
-        DIR *src_dirp = opendir(src);
-    	if(src_dirp == NULL) {
-    		perror("source dir");
-            if(chmod(dir_path, src_info.st_mode) != 0){
-                perror("Directory permissions couldn't be set");
-            }
-    		return -1;
-    	}
-
-        errno = 0;
-        dp = readdir(src_dirp);
-        /*
-            Value of dp could be NULL if src_dirp has no items. Explicit check
-            of errno is required and errno has been set to 0 before readdir to
-            account for any previous errors.
-        */
-        if(errno != 0 && dp == NULL) {
-            perror("readdir");
-        }
-
-        /*
-            Iterate over the directory 'src' and copy valid items in 'src' over
-            to the directory in 'dest'.
-        */
-        while(dp != NULL) {
+    if(threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
 
-            if(dp->d_name[0] != '.') {
-                int src_item_len = strlen(src) + strlen(dp->d_name) + 2;
-                char *src_item = get_path(src, dp->d_name, src_item_len);
+    struct copier copier;
+    memset(&copier, 0, sizeof(copier));
+    copier.nworkers = threads;
+    copier.flags = flags;
+    copier.workers = calloc(threads, sizeof(struct copy_worker));
+    if(copier.workers == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    pthread_mutex_init(&copier.idle_lock, NULL);
+    pthread_cond_init(&copier.idle_cond, NULL);
+    pthread_mutex_init(&copier.links_lock, NULL);
+    pthread_cond_init(&copier.links_cond, NULL);
+    for(int i = 0; i < threads; i++) {
+        pthread_mutex_init(&copier.workers[i].lock, NULL);
+        copier.workers[i].copier = &copier;
+        copier.workers[i].seed = i + 1;
+    }
 
-                if(lstat(src_item, &src_item_info) != 0) {
-                    perror("lstat");
-                    if(processes > 0) {
-                        processes = -processes;
-                    }
-                }
+    struct copy_task top;
+    top.src = strdup(src);
+    if(top.src == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    top.dest = dest;
+    top.parent = NULL;
+    top.info = src_info;
+    push_task(&copier.workers[0], &top);
 
-                // Fork a new process to copy the sub-directory encountered.
-                if(S_ISDIR(src_item_info.st_mode)) {
-                    int pid = fork();
-                    if (pid == 0) { // Recursively call copy_ftree in child.
-                        exit(copy_ftree(src_item, dir_path));
-                    }
-                    else if (pid > 0){
-                        num_children += 1;
-                    }
-                    else {
-                        perror("Fork");
-                        if(processes > 0) {
-                            processes = -processes;
-                        }
-                    }
-                }
-                // Copy the file that's encountered into the directory dest.
-                else if(S_ISREG(src_item_info.st_mode)) {
-                    flag += copy_file(src_item, dir_path, src_item_info.st_mode,
-                              src_item_info.st_size);
-                    if(flag == -1 && processes > 0) {
-                        processes = -processes;
-                    }
-                }
-                free(src_item);
-            }
-            errno = 0;
-            dp = readdir(src_dirp);
-            if(errno != 0 && dp == NULL) {
-                perror("readdir");
-            }
-        }
-        closedir(src_dirp);
-
-        int status;
-        // Wait for all the children of this process to terminate.
-        for(int i = 0; i < num_children; i++) {
-            if (wait(&status) != -1) {
-                if (WIFEXITED(status)) {
-                    // Update value of processes according to whether
-                    // the child exited with error.
-                    if((processes * (char)WEXITSTATUS(status)) > 0) {
-                        processes += WEXITSTATUS(status);
-                    }
-                    else if((char)WEXITSTATUS(status) < 0) {
-                        processes += (-1)*WEXITSTATUS(status);
-                        processes = -processes;
-                    }
-                    else {
-                        processes = -processes;
-                        processes += WEXITSTATUS(status);
-                        processes = -processes;
-                    }
-                }
-            }
+    int started = 1;
+    for(; started < threads; started++) {
+        if(pthread_create(&copier.workers[started].tid, NULL, worker_main,
+                          &copier.workers[started]) != 0) {
+            // Make do with the threads that did start.
+            perror("pthread_create");
+            break;
         }
+    }
+    worker_main(&copier.workers[0]);
+    for(int i = 1; i < started; i++) {
+        pthread_join(copier.workers[i].tid, NULL);
+    }
 
-        // Change permissions of the copied directory to that of the
-        // directory in src.
-        if (chmod(dir_path, src_info.st_mode) != 0) {
-            perror("Directory permissions couldn't be changed");
-            if(processes > 0) {
-                processes = -processes;
-            }
+    for(int i = 0; i < threads; i++) {
+        free(copier.workers[i].tasks);
+        pthread_mutex_destroy(&copier.workers[i].lock);
+    }
+    pthread_cond_destroy(&copier.idle_cond);
+    pthread_mutex_destroy(&copier.idle_lock);
+    free(copier.workers);
+    for(size_t i = 0; i < copier.links_cap; i++) {
+        while(copier.links[i] != NULL) {
+            struct link_entry *entry = copier.links[i];
+            copier.links[i] = entry->next;
+            free(entry->path);
+            free(entry);
         }
-        free(dir_path);
     }
+    free(copier.links);
+    pthread_cond_destroy(&copier.links_cond);
+    pthread_mutex_destroy(&copier.links_lock);
 
-    return processes;
+    return copier.errors > 0 ? -started : started;
 }
 
 
 /*
-    Creates a copy of the regular file src in the directory dest.
+    Creates a copy of the regular file src, whose status is info, in the
+    directory dest.
     Returns an error if src doesn't have valid permissions or if there
     exists a directory with the same name or a regular file with same name
     that doesn't have valid permissions.
+
+    A file in dest with the same size and modification time (to the
+    nanosecond) as src is taken to be up to date, so checking it costs
+    one lstat and neither file is opened, unless flags has COPY_CHECKSUM,
+    in which case their contents are compared. Every copy is given the
+    modification time of src, so that it will pass the check next time.
 */
-int copy_file(const char *src, const char *dest, mode_t perm, off_t size) {
-    FILE *dest_f;
+int copy_file(const char *src, const char *dest, const struct stat *info,
+              int flags) {
     FILE *src_f;
+    mode_t perm = info->st_mode;
     char *src_name = get_name(src); // Get the name of the file.
+    int f_path_len = strlen(dest) + strlen(src_name) + 2;
+    char *f_path = get_path(dest, src_name, f_path_len);
+    free(src_name);
+
+    struct stat item_info, src_info;
+    int exists = lstat(f_path, &item_info) == 0;
+    if(!exists && errno != ENOENT) {
+        perror("lstat - file in dest");
+        free(f_path);
+        return -1;
+    }
+    if(exists && S_ISDIR(item_info.st_mode)) {
+        printf("Type mismatch.\n"); // Return error if the types don't match.
+        free(f_path);
+        return -1;
+    }
+    /*
+        A file in dest with other links may share its inode with files
+        that src doesn't link to this one (say, a link since broken in
+        src), which updating it in place, or even chmod-ing it, would
+        change too. Unless src has other links itself, and so is the
+        first of its group for the others to link to, copy it afresh.
+    */
+    if(exists && item_info.st_nlink > 1 && info->st_nlink < 2) {
+        if(unlink(f_path) != 0) {
+            perror("unlink - file in dest");
+            free(f_path);
+            return -1;
+        }
+        exists = 0;
+    }
+    if(exists && !(flags & COPY_CHECKSUM) &&
+       item_info.st_size == info->st_size && same_mtime(&item_info, info)) {
+        int ret = keep_file(f_path, &item_info, perm);
+        free(f_path);
+        return ret;
+    }
+
     src_f = fopen(src, "r");
     if(src_f == NULL) { // Return error if src doesn't have read permissions.
         perror("Source file can't be opened");
+        free(f_path);
+        return -1;
+    }
+    // Status of src from before it's read, to key its hash cache entry
+    // and give the copy its modification time.
+    if(fstat(fileno(src_f), &src_info) != 0) {
+        perror("fstat");
+        fclose(src_f);
+        free(f_path);
         return -1;
     }
-    struct stat item_info;
-
-    int f_path_len = strlen(dest) + strlen(src_name) + 2;
-    char *f_path = get_path(dest, src_name, f_path_len);
 
-    if(lstat(f_path, &item_info) != 0) {
-        if(errno != ENOENT) {
-            perror("lstat - file in dest");
+    if(exists) {
+        /*
+            Leave the contents of the file in dest alone if the hash cache
+            already knows that they match src, without reading either of
+            them. It isn't even chmod-ed unless its permissions are wrong,
+            or given the modification time of src unless it has another,
+            since either would change its status and so invalidate its cache
+            entry, which is then recorded again. Without the time, the quick
+            check would fail on it every time.
+        */
+        if(src_info.st_size == item_info.st_size &&
+           cached_match(&src_info, &item_info)) {
+            fclose(src_f);
+            int stale = (item_info.st_mode & 07777) != (perm & 07777) ||
+                        !same_mtime(&item_info, &src_info);
+            int ret = keep_file(f_path, &item_info, perm);
+            char hash_val[BLOCK_SIZE];
+            if(ret == 0 && !same_mtime(&item_info, &src_info)) {
+                ret = set_mtime(f_path, &src_info);
+                if(ret != 0) {
+                    perror("File times couldn't be changed");
+                }
+            }
+            if(ret == 0 && stale && hash_cache_get(&src_info, hash_val)) {
+                cache_copy(-1, &src_info, f_path, hash_val);
+            }
+            free(f_path);
+            return ret;
+        }
+        chmod(f_path, 00777);
+        int dest_fd = open(f_path, O_RDWR);
+        // Return error if the file in dest doesn't have read permissions.
+        if(dest_fd == -1) {
+            perror("File in destination can't be opened");
             free(f_path);
             fclose(src_f);
             return -1;
         }
-    }
+        // Bring the file in dest up to date in place, only rewriting the
+        // parts of it that differ from src.
+        char hash_val[BLOCK_SIZE];
+        int ret = update_file(fileno(src_f), src_info.st_size, dest_fd,
+                              hash_val);
+        close(dest_fd);
 
-    else {
-        if(S_ISDIR(item_info.st_mode)) {//Return error if the types don't match.
-            printf("Type mismatch.\n");
+        if(ret == -1 || chmod(f_path, perm) != 0 ||
+           set_mtime(f_path, &src_info) != 0) {
+            perror("File couldn't be updated");
+            fclose(src_f);
+            free(f_path);
             return -1;
         }
-        else {
-            chmod(f_path, 00777);
-            if(size == item_info.st_size) {
-                dest_f = fopen(f_path, "r");
-                // Return error if the file in dest doesn't have read
-                // permissions.
-                if(dest_f == NULL) {
-                    perror("File in destination can't be opened");
-                    free(f_path);
-                    fclose(src_f);
-                    return -1;
-                }
-                // Compute hash if files have same size.
-                char *src_hash = hash(src_f);
-                rewind(src_f);
-                char *f_path_hash = hash(dest_f);
-                fclose(dest_f);
-
-                if(strcmp(src_hash, f_path_hash) == 0) {
-                    fclose(src_f);
-                    if (chmod(f_path, perm) != 0) {
-                        perror("File permissions couldn't be changed");
-                        return -1;
-                    }
-                    else {
-                        return 0;
-                    }
-                }
-            }
-        }
+        cache_copy(fileno(src_f), &src_info, f_path, hash_val);
+        fclose(src_f);
+        free(f_path);
+        return 0;
     }
 
-    dest_f = fopen(f_path, "w");
+    int dest_fd = open(f_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     // Return error if file in dest doesn't have write permissions.
-    if(dest_f == NULL) {
+    if(dest_fd == -1) {
         perror("File in destination can't be written");
         fclose(src_f);
         free(f_path);
         return -1;
     }
-    char buf;
-    // Read data from src and write to file in dest.
-    while (fread(&buf, sizeof(char), 1, src_f) != 0) {
-        fwrite(&buf, sizeof(char), 1, dest_f);
+    // Copy the data over without reading it in here, where the file
+    // systems allow.
+    int copied = copy_data(fileno(src_f), dest_fd) != -1;
+    if(!copied) {
+        perror("Couldn't copy file");
+    }
+    if(close(dest_fd) != 0) {
+        copied = 0;
+    }
+
+    // Change permissions of the copied file to that of the file src. A
+    // copy that failed keeps the time it was written, so that it doesn't
+    // look up to date.
+    if (chmod(f_path, perm) != 0 ||
+        (copied && set_mtime(f_path, &src_info) != 0)) {
+        perror("File permissions or times couldn't be changed");
+        fclose(src_f);
+        free(f_path);
+        return -1;
+    }
+    // The data wasn't hashed on the way, so src is only read for its hash
+    // if the cache is on and doesn't have it already.
+    char hash_val[BLOCK_SIZE];
+    if(copied && (hash_cache_get(&src_info, hash_val) ||
+                  (hash_cache_enabled() &&
+                   hash_fd(hash_val, fileno(src_f)) == 0))) {
+        cache_copy(fileno(src_f), &src_info, f_path, hash_val);
     }
-    fclose(dest_f);
     fclose(src_f);
+    free(f_path);
+    return copied ? 0 : -1;
+}
 
-    // Change permissions of the copied file to that of the file src.
-    if (chmod(f_path, perm) != 0) {
+/*
+    Gives the file at path, which is up to date and whose status is info,
+    the permissions perm, unless it has them already. Returns -1 on error.
+*/
+int keep_file(const char *path, const struct stat *info, mode_t perm) {
+    if((info->st_mode & 07777) != (perm & 07777) && chmod(path, perm) != 0) {
         perror("File permissions couldn't be changed");
-        free(f_path);
         return -1;
     }
-    else {
-        free(f_path);
-        return 0;
+    return 0;
+}
+
+/*
+    Returns 1 if the files described by a and b have the same modification
+    time, to the nanosecond.
+*/
+int same_mtime(const struct stat *a, const struct stat *b) {
+    return a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+    Gives the file at path the modification time of the file described by
+    src_info, leaving its access time alone. Must be called after anything
+    else that writes to it. Returns -1 on error.
+*/
+int set_mtime(const char *path, const struct stat *src_info) {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = src_info->st_mtim;
+    return utimensat(AT_FDCWD, path, times, 0);
+}
+
+
+/*
+    Brings the file open on dest_fd up to date with the file open on src_fd,
+    which is 'size' bytes long, rewriting as little of dest as possible.
+    The part of the files they have in common is mapped and compared chunk
+    by chunk straight out of the page cache, and only chunks of dest that
+    differ are overwritten in place from the mapping of src. Whatever src
+    has past the end of dest is appended, and dest is truncated if it's
+    longer than src, so appending to or patching a big file costs writes
+    proportional to the change rather than to the size of the file.
+    Holes in src aren't read: holes are punched in dest where it has data
+    instead, or zeros written where the file system can't punch them.
+    src is hashed in the same pass and its hash stored in hash_val. Either
+    file being truncated meanwhile is an error, not SIGBUS (see run_mapped).
+    Returns 1 if dest was changed, 0 if it already had the contents of src
+    and -1 on error.
+*/
+int update_file(int src_fd, off_t size, int dest_fd, char *hash_val) {
+    struct hash_ctx ctx;
+    struct stat src_info, dest_info;
+    int changed = 0;
+
+    if(fstat(src_fd, &src_info) != 0 || fstat(dest_fd, &dest_info) != 0) {
+        perror("fstat");
+        return -1;
+    }
+    off_t dest_size = dest_info.st_size;
+    int sparse = may_have_holes(&src_info);
+
+    hash_init(&ctx);
+    off_t offset = 0;
+    while(offset < size) {
+        off_t hole = offset;
+        off_t end = sparse ? data_run(src_fd, &offset, size) : size;
+        if(offset > hole) {
+            int ret = punch_hole(dest_fd, hole, offset, dest_size);
+            if(ret == -1) {
+                offset = hole; // Compare it as data after all.
+            }
+            else {
+                hash_skip(&ctx, offset - hole);
+                changed |= ret;
+            }
+        }
+        int ret = update_range(src_fd, dest_fd, dest_size, offset, end, &ctx);
+        if(ret == -1) {
+            return -1;
+        }
+        changed |= ret;
+        offset = end;
+    }
+
+    // A hole at the end of src leaves dest short of it.
+    if(dest_size != size) {
+        if(ftruncate(dest_fd, size) != 0) {
+            perror("Couldn't truncate file in destination");
+            return -1;
+        }
+        changed = 1;
+    }
+    hash_final(&ctx, hash_val);
+    return changed;
+}
+
+/*
+    One window of update_range: the mappings of src and dest, how much of it
+    dest has, and what came of comparing them.
+*/
+struct update_window {
+    int dest_fd;
+    off_t offset;
+    size_t len;
+    size_t common;
+    const char *src_map;
+    const char *dest_map;
+    struct hash_ctx *ctx;
+    int changed;
+    int failed;
+};
+
+/*
+    Compares and updates one window of update_range, under run_mapped so
+    that a file truncated meanwhile is an error rather than SIGBUS.
+*/
+static void update_window(void *arg) {
+    struct update_window *w = arg;
+    for(size_t pos = 0; pos < w->common && !w->failed; pos += COPY_BUF_SIZE) {
+        size_t chunk = w->common - pos < COPY_BUF_SIZE ?
+                       w->common - pos : COPY_BUF_SIZE;
+        if(memcmp(w->src_map + pos, w->dest_map + pos, chunk) != 0) {
+            w->failed = pwrite_all(w->dest_fd, w->src_map + pos, chunk,
+                                   w->offset + pos);
+            w->changed = 1;
+        }
+    }
+    if(!w->failed && w->common < w->len) {
+        w->failed = pwrite_all(w->dest_fd, w->src_map + w->common,
+                               w->len - w->common, w->offset + w->common);
+        w->changed = 1;
+    }
+    hash_update(w->ctx, w->src_map, w->len);
+}
+
+/*
+    Does the work of update_file for bytes start to end of src, where dest
+    was dest_size bytes long, folding them into ctx. start must be a
+    multiple of the page size. Returns the same as update_file.
+*/
+int update_range(int src_fd, int dest_fd, off_t dest_size, off_t start,
+                 off_t end, struct hash_ctx *ctx) {
+    int changed = 0;
+    for(off_t offset = start; offset < end; offset += COPY_MAP_WINDOW) {
+        size_t len = COPY_MAP_WINDOW;
+        if(end - offset < COPY_MAP_WINDOW) {
+            len = end - offset;
+        }
+        // Amount of this window that dest already has.
+        size_t common = 0;
+        if(dest_size > offset) {
+            common = dest_size - offset < len ? dest_size - offset : len;
+        }
+
+        char *src_map = map_sequential(src_fd, offset, len);
+        char *dest_map = MAP_FAILED;
+        if(src_map == MAP_FAILED ||
+           (common > 0 &&
+            (dest_map = map_sequential(dest_fd, offset, common)) ==
+            MAP_FAILED)) {
+            perror("mmap");
+            if(src_map != MAP_FAILED) {
+                munmap(src_map, len);
+            }
+            return -1;
+        }
+
+        struct update_window window = {dest_fd, offset, len, common, src_map,
+                                       dest_map, ctx, 0, 0};
+        int truncated = run_mapped(update_window, &window) != 0;
+
+        munmap(src_map, len);
+        if(dest_map != MAP_FAILED) {
+            munmap(dest_map, common);
+        }
+        if(truncated) {
+            perror("File was truncated while it was copied");
+            return -1;
+        }
+        if(window.failed) {
+            perror("Couldn't update file in destination");
+            return -1;
+        }
+        changed |= window.changed;
+    }
+    return changed;
+}
+
+
+/*
+    Returns 1 if the hash cache has current entries for both of the files
+    described by src_info and dest_info, and they have the same hash.
+    Returns 0 otherwise, including when the cache is off.
+*/
+int cached_match(const struct stat *src_info, const struct stat *dest_info) {
+    char src_hash[BLOCK_SIZE], dest_hash[BLOCK_SIZE];
+    return hash_cache_get(src_info, src_hash) &&
+           hash_cache_get(dest_info, dest_hash) &&
+           memcmp(src_hash, dest_hash, BLOCK_SIZE) == 0;
+}
+
+/*
+    Records hash_val in the hash cache as the hash of both the source file
+    open on src_fd and described by src_info (its status from before it was
+    read) and the file at dest it was just copied to. src_fd is -1 if src
+    wasn't read, so src_info is current. Must be called after dest's
+    permissions are set, so that its entry stays current. Neither is
+    recorded if src changed while it was copied.
+*/
+void cache_copy(int src_fd, const struct stat *src_info, const char *dest,
+                const char *hash_val) {
+    struct stat dest_info;
+    if(hash_cache_put(src_fd, src_info, hash_val) &&
+       stat(dest, &dest_info) == 0) {
+        hash_cache_put(-1, &dest_info, hash_val);
     }
 }
 
@@ -1,11 +1,25 @@
 #ifndef _FTREE_H_
 #define _FTREE_H_
 
+/* Flags for copy_ftree_parallel. By default a file in dest is
+ * taken to be up to date when its size and modification time
+ * match those of the file in src, as with rsync.
+ */
+#define COPY_CHECKSUM 0x1   // Compare contents instead.
+
 /* Function for copying a file tree rooted at src to dest
  * Returns < 0 on error. The magnitude of the return value
- * is the number of processes involved in the copy and is
+ * is the number of threads involved in the copy and is
  * at least 1.
  */
 int copy_ftree(const char *src, const char *dest);
 
+/* Function for copying a file tree rooted at src to dest on
+ * a pool of 'threads' threads, or one per online CPU if
+ * threads is 0, with COPY_* flags. Returns the same as
+ * copy_ftree.
+ */
+int copy_ftree_parallel(const char *src, const char *dest, int threads,
+                        int flags);
+
 #endif // _FTREE_H_
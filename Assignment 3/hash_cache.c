@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "hash.h"
+
+/*
+    A persistent cache of file hashes, so that files that haven't changed
+    since they were last hashed don't have to be read again.
+
+    The cache is a file made of a header followed by an open-addressed table
+    of entries, which is mapped shared into every process using it. Entries
+    are keyed by device and inode, and hold the size, modification time and
+    status change time the file had when it was hashed. A lookup only hits
+    if all of those still match, so any write, truncation or chmod of the
+    file invalidates its entry. A write in the same timestamp tick as the
+    hash wouldn't, so a file modified that recently isn't cached at all.
+
+    Several processes or threads may update the table at once without
+    locking. Each entry ends with a checksum of its fields that is written
+    last, so an entry torn by concurrent writers just reads as a miss.
+    The cache is only grown when it's opened, under an flock.
+*/
+
+// Environment variable naming the cache file. Caching is off if unset.
+#define CACHE_ENV "FTREE_HASHCACHE"
+
+#define CACHE_MAGIC "FTHCACHE"
+#define CACHE_VERSION 1
+
+// Size of the header. The table starts on the page after it.
+#define CACHE_HEADER_SIZE 4096
+
+// Number of entries in a new cache. Always a power of 2.
+#define CACHE_MIN_CAPACITY (64 * 1024)
+
+// Slots probed for a key before its home slot is evicted instead.
+#define CACHE_MAX_PROBE 32
+
+// How recently a file can have been modified and still have its hash
+// cached, in nanoseconds. A write in the same timestamp tick as the hash
+// wouldn't change the file's mtime, so the entry would look current while
+// holding the old hash. Covers the 2 second mtimes of FAT.
+#define CACHE_RACY_NS 2000000000LL
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t capacity;
+    uint64_t entries;           // Slots filled since the table was built.
+};
+
+struct cache_entry {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    char digest[BLOCK_SIZE];
+    uint64_t check;             // Checksum of the fields above, 0 if empty.
+};
+
+static struct cache_header *cache = NULL;
+static struct cache_entry *table;
+static size_t cache_len;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+
+/*
+    Mixes x into h (the finalizer of splitmix64).
+*/
+static uint64_t mix(uint64_t h, uint64_t x) {
+    h ^= x + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static uint64_t entry_check(const struct cache_entry *entry) {
+    uint64_t digest;
+    memcpy(&digest, entry->digest, sizeof(digest) < BLOCK_SIZE ?
+                                   sizeof(digest) : BLOCK_SIZE);
+    uint64_t h = mix(mix(mix(entry->dev, entry->ino), entry->size),
+                     mix(entry->mtime_ns, entry->ctime_ns));
+    return mix(h, digest) | 1;
+}
+
+static void entry_key(struct cache_entry *entry, const struct stat *info) {
+    entry->dev = info->st_dev;
+    entry->ino = info->st_ino;
+    entry->size = info->st_size;
+    entry->mtime_ns = info->st_mtim.tv_sec * 1000000000LL +
+                      info->st_mtim.tv_nsec;
+    entry->ctime_ns = info->st_ctim.tv_sec * 1000000000LL +
+                      info->st_ctim.tv_nsec;
+}
+
+/*
+    Returns 1 if the entries a and b are for the same file in the same
+    state: the same inode, size, modification time and status change time.
+*/
+static int same_key(const struct cache_entry *a, const struct cache_entry *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
+}
+
+/*
+    Returns 1 if a hash of the file open on fd (or -1 if info is its status
+    from after it was hashed) can be cached under info, its status from
+    before it was hashed: the file hasn't changed since, and wasn't
+    modified so recently that a change in the same timestamp tick as the
+    hash could have left its mtime and ctime as they were.
+*/
+static int settled(int fd, const struct stat *info) {
+    struct cache_entry before, after;
+    struct stat now_info;
+    struct timespec now;
+    entry_key(&before, info);
+    if(fd != -1) {
+        if(fstat(fd, &now_info) != 0) {
+            return 0;
+        }
+        entry_key(&after, &now_info);
+        if(!same_key(&before, &after)) {
+            return 0;
+        }
+    }
+    if(clock_gettime(CLOCK_REALTIME, &now) != 0) {
+        return 0;
+    }
+    return now.tv_sec * 1000000000LL + now.tv_nsec - before.mtime_ns >=
+           CACHE_RACY_NS;
+}
+
+/*
+    Copies the entry in slot into out. Returns 1 if it holds a complete
+    entry and 0 if it's empty or was torn by a concurrent write.
+*/
+static int read_slot(struct cache_entry *slot, struct cache_entry *out) {
+    out->check = __atomic_load_n(&slot->check, __ATOMIC_ACQUIRE);
+    memcpy(out, slot, offsetof(struct cache_entry, check));
+    return out->check != 0 && out->check == entry_check(out);
+}
+
+static void write_slot(struct cache_entry *slot,
+                       const struct cache_entry *entry) {
+    __atomic_store_n(&slot->check, 0, __ATOMIC_RELAXED);
+    memcpy(slot, entry, offsetof(struct cache_entry, check));
+    __atomic_store_n(&slot->check, entry->check, __ATOMIC_RELEASE);
+}
+
+/*
+    Finds the slot for the inode in key among the capacity slots of table:
+    the one already holding it, else the first empty one, else NULL.
+*/
+static struct cache_entry *find_slot(struct cache_entry *table,
+                                     uint64_t capacity,
+                                     const struct cache_entry *key) {
+    uint64_t home = mix(key->dev, key->ino) & (capacity - 1);
+    for(uint64_t i = 0; i < CACHE_MAX_PROBE && i < capacity; i++) {
+        struct cache_entry *slot = &table[(home + i) & (capacity - 1)];
+        struct cache_entry entry;
+        if(!read_slot(slot, &entry) ||
+           (entry.dev == key->dev && entry.ino == key->ino)) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Writes an empty cache with room for capacity entries to fd.
+    Returns 0 on success and -1 on error.
+*/
+static int init_cache_file(int fd, uint64_t capacity) {
+    struct cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.block_size = BLOCK_SIZE;
+    header.capacity = capacity;
+    if(ftruncate(fd, 0) != 0 ||
+       ftruncate(fd, CACHE_HEADER_SIZE +
+                     capacity * sizeof(struct cache_entry)) != 0 ||
+       pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Rebuilds the cache at path with room for capacity entries, copying over
+    the valid entries of the old table. Returns a descriptor for the new
+    file, or -1 on error.
+*/
+static int grow_cache(const char *path, struct cache_entry *old_table,
+                      uint64_t old_capacity, uint64_t capacity) {
+    char *tmp_path = malloc(strlen(path) + 5);
+    if(tmp_path == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1 || init_cache_file(fd, capacity) != 0) {
+        perror(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    size_t len = CACHE_HEADER_SIZE + capacity * sizeof(struct cache_entry);
+    struct cache_header *header = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED, fd, 0);
+    if(header == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    struct cache_entry *new_table = (struct cache_entry *)
+                                    ((char *)header + CACHE_HEADER_SIZE);
+    for(uint64_t i = 0; i < old_capacity; i++) {
+        struct cache_entry entry;
+        struct cache_entry *slot;
+        if(read_slot(&old_table[i], &entry) &&
+           (slot = find_slot(new_table, capacity, &entry)) != NULL) {
+            write_slot(slot, &entry);
+            header->entries++;
+        }
+    }
+    munmap(header, len);
+
+    // Take the lock on the new file before it replaces the old one.
+    flock(fd, LOCK_EX);
+    if(rename(tmp_path, path) != 0) {
+        perror("rename");
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+    return fd;
+}
+
+/*
+    Opens and maps the cache named by CACHE_ENV, creating it if it doesn't
+    exist, or growing it if it's getting full.
+*/
+static void open_cache(void) {
+    const char *path = getenv(CACHE_ENV);
+    struct cache_header header;
+    struct stat info;
+    if(path == NULL || *path == '\0') {
+        return;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd == -1 || flock(fd, LOCK_EX) != 0 || fstat(fd, &info) != 0) {
+        perror(path);
+        if(fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    // Start over if the file is new, from another version or corrupt.
+    if(info.st_size < CACHE_HEADER_SIZE ||
+       pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+       memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+       header.version != CACHE_VERSION || header.block_size != BLOCK_SIZE ||
+       header.capacity == 0 || (header.capacity & (header.capacity - 1)) ||
+       info.st_size != CACHE_HEADER_SIZE +
+                       header.capacity * sizeof(struct cache_entry)) {
+        if(init_cache_file(fd, CACHE_MIN_CAPACITY) != 0) {
+            perror(path);
+            close(fd);
+            return;
+        }
+        header.capacity = CACHE_MIN_CAPACITY;
+        header.entries = 0;
+    }
+
+    size_t len = CACHE_HEADER_SIZE +
+                 header.capacity * sizeof(struct cache_entry);
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return;
+    }
+
+    // Keep the table under half full, going by how many slots were filled
+    // last time it was used.
+    if(header.entries > header.capacity / 2) {
+        uint64_t capacity = header.capacity;
+        while(capacity < 4 * header.entries) {
+            capacity *= 2;
+        }
+        int new_fd = grow_cache(path,
+                                (struct cache_entry *)((char *)map +
+                                                       CACHE_HEADER_SIZE),
+                                header.capacity, capacity);
+        if(new_fd != -1) {
+            munmap(map, len);
+            close(fd);
+            fd = new_fd;
+            len = CACHE_HEADER_SIZE + capacity * sizeof(struct cache_entry);
+            map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(map == MAP_FAILED) {
+                perror("mmap");
+                close(fd);
+                return;
+            }
+        }
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+    cache = map;
+    table = (struct cache_entry *)((char *)map + CACHE_HEADER_SIZE);
+    cache_len = len;
+}
+
+
+/*
+    Looks up the hash of the regular file described by info. Returns 1 and
+    copies the hash into hash_val if the cache has an entry for the file
+    that is still current, and 0 otherwise (or if caching is off).
+*/
+int hash_cache_get(const struct stat *info, char *hash_val) {
+    struct cache_entry key, entry;
+    pthread_once(&cache_once, open_cache);
+    if(cache == NULL) {
+        return 0;
+    }
+
+    entry_key(&key, info);
+    struct cache_entry *slot = find_slot(table, cache->capacity, &key);
+    if(slot == NULL || !read_slot(slot, &entry) || !same_key(&entry, &key)) {
+        return 0;
+    }
+    memcpy(hash_val, entry.digest, BLOCK_SIZE);
+    return 1;
+}
+
+/*
+    Records hash_val as the hash of the regular file described by info,
+    which must be the file's status from before it was hashed. fd is the
+    file, still open, or -1 if info was taken after it was hashed. Nothing
+    is recorded if the file has changed since info was taken or was
+    modified too recently to tell a later change from this state (see
+    CACHE_RACY_NS). Returns 1 if the hash was recorded.
+*/
+int hash_cache_put(int fd, const struct stat *info, const char *hash_val) {
+    struct cache_entry entry;
+    pthread_once(&cache_once, open_cache);
+    if(cache == NULL || !settled(fd, info)) {
+        return 0;
+    }
+
+    entry_key(&entry, info);
+    memcpy(entry.digest, hash_val, BLOCK_SIZE);
+    entry.check = entry_check(&entry);
+
+    struct cache_entry *slot = find_slot(table, cache->capacity, &entry);
+    struct cache_entry old;
+    if(slot == NULL) {
+        // Evict whatever lives in the home slot.
+        slot = &table[mix(entry.dev, entry.ino) & (cache->capacity - 1)];
+        __atomic_fetch_add(&cache->entries, 1, __ATOMIC_RELAXED);
+    }
+    else if(!read_slot(slot, &old)) {
+        __atomic_fetch_add(&cache->entries, 1, __ATOMIC_RELAXED);
+    }
+    write_slot(slot, &entry);
+    return 1;
+}
+
+/*
+    Returns 1 if the hash cache is on, so that hash_cache_get and
+    hash_cache_put will use it, and 0 otherwise.
+*/
+int hash_cache_enabled(void) {
+    pthread_once(&cache_once, open_cache);
+    return cache != NULL;
+}
+
+/*
+    Returns the hash of the regular file at path, whose status is info, in
+    dynamically allocated memory. The cached hash is used if it's current;
+    otherwise the file is hashed and the result cached. Returns NULL (with
+    errno set) if the file couldn't be read or memory ran out.
+*/
+char *hash_cached(const char *path, const struct stat *info) {
+    char *hash_val = malloc(sizeof(char)*BLOCK_SIZE);
+    if(hash_val == NULL) {
+        return NULL;
+    }
+    if(hash_cache_get(info, hash_val)) {
+        return hash_val;
+    }
+    int fd = open(path, O_RDONLY);
+    if(fd == -1 || hash_fd(hash_val, fd) != 0) {
+        int saved_errno = errno;
+        if(fd != -1) {
+            close(fd);
+        }
+        free(hash_val);
+        errno = saved_errno;
+        return NULL;
+    }
+    hash_cache_put(fd, info, hash_val);
+    close(fd);
+    return hash_val;
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "dir_reader.h"
+
+#ifdef SYS_getdents64
+    #define DIR_GETDENTS
+#endif
+
+// Size of the buffer a directory is first read with. It's doubled after
+// every batch that leaves more to read, up to the size set by
+// dir_set_buffer_size, so that only big directories use big buffers.
+#define DIR_BUF_MIN (32 * 1024)
+#define DIR_BUF_MAX (1024 * 1024)
+
+struct dir_reader {
+    int fd;
+#ifdef DIR_GETDENTS
+    char *buf;
+    size_t size;                 // Size of buf.
+    size_t len;                  // Bytes of buf filled by the last batch.
+    size_t pos;                  // Offset of the next entry in buf.
+    int eof;
+#else
+    DIR *dirp;
+#endif
+};
+
+#ifdef DIR_GETDENTS
+// Record of a directory entry as returned by getdents64.
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static size_t max_buffer_size = DIR_BUF_MAX;
+
+
+/*
+    Sets the most memory used to read each directory (1 MB by default).
+    Bigger buffers need fewer system calls to read huge directories.
+*/
+void dir_set_buffer_size(size_t size) {
+    max_buffer_size = size < DIR_BUF_MIN ? DIR_BUF_MIN : size;
+}
+
+/*
+    Returns the S_IF* type of a d_type, or 0 if it's DT_UNKNOWN.
+*/
+static mode_t dtype_to_mode(unsigned char type) {
+    switch(type) {
+    case DT_DIR:
+        return S_IFDIR;
+    case DT_REG:
+        return S_IFREG;
+    case DT_LNK:
+        return S_IFLNK;
+    case DT_FIFO:
+        return S_IFIFO;
+    case DT_SOCK:
+        return S_IFSOCK;
+    case DT_CHR:
+        return S_IFCHR;
+    case DT_BLK:
+        return S_IFBLK;
+    default:
+        return 0;
+    }
+}
+
+/*
+    Starts reading the directory open on fd, which is closed by dir_close.
+    Returns NULL (with errno set) on error.
+*/
+struct dir_reader *dir_fdopen(int fd) {
+    struct dir_reader *dir = malloc(sizeof(struct dir_reader));
+    if(dir == NULL) {
+        return NULL;
+    }
+    dir->fd = fd;
+#ifdef DIR_GETDENTS
+    dir->size = DIR_BUF_MIN;
+    dir->buf = malloc(dir->size);
+    dir->len = 0;
+    dir->pos = 0;
+    dir->eof = 0;
+    if(dir->buf == NULL) {
+        free(dir);
+        return NULL;
+    }
+#else
+    dir->dirp = fdopendir(fd);
+    if(dir->dirp == NULL) {
+        free(dir);
+        return NULL;
+    }
+#endif
+    return dir;
+}
+
+/*
+    Starts reading the directory path (relative to the directory open on
+    dirfd, or to the working directory if dirfd is AT_FDCWD). A symbolic
+    link isn't followed. Returns NULL (with errno set) on error.
+*/
+struct dir_reader *dir_open(int dirfd, const char *path) {
+    int fd = openat(dirfd, path,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd == -1) {
+        return NULL;
+    }
+    struct dir_reader *dir = dir_fdopen(fd);
+    if(dir == NULL) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+    return dir;
+}
+
+/*
+    Stores the next entry of dir (including "." and "..") in entry.
+    Returns 1 if there was one, 0 at the end of the directory and -1 (with
+    errno set) on error.
+*/
+int dir_next(struct dir_reader *dir, struct dir_entry *entry) {
+#ifdef DIR_GETDENTS
+    if(dir->pos >= dir->len) {
+        if(dir->eof) {
+            return 0;
+        }
+        // Grow the buffer if the last batch didn't get everything. Its
+        // entries have all been returned, so they needn't be copied.
+        if(dir->len > 0 && dir->size < max_buffer_size) {
+            size_t size = dir->size * 2 < max_buffer_size ?
+                          dir->size * 2 : max_buffer_size;
+            char *buf = malloc(size);
+            if(buf != NULL) {
+                free(dir->buf);
+                dir->buf = buf;
+                dir->size = size;
+            }
+        }
+        long nread = syscall(SYS_getdents64, dir->fd, dir->buf, dir->size);
+        if(nread < 0) {
+            return -1;
+        }
+        if(nread == 0) {
+            dir->eof = 1;
+            return 0;
+        }
+        dir->len = nread;
+        dir->pos = 0;
+    }
+    struct linux_dirent64 *dp = (struct linux_dirent64 *)(dir->buf +
+                                                          dir->pos);
+    dir->pos += dp->d_reclen;
+    entry->name = dp->d_name;
+    entry->ino = dp->d_ino;
+    entry->type = dtype_to_mode(dp->d_type);
+    return 1;
+#else
+    struct dirent *dp;
+    errno = 0;
+    if((dp = readdir(dir->dirp)) == NULL) {
+        return errno == 0 ? 0 : -1;
+    }
+    entry->name = dp->d_name;
+    entry->ino = dp->d_ino;
+#ifdef _DIRENT_HAVE_D_TYPE
+    entry->type = dtype_to_mode(dp->d_type);
+#else
+    entry->type = 0;
+#endif
+    return 1;
+#endif
+}
+
+/*
+    Returns the file descriptor dir is reading, to open or stat the files
+    in it relative to.
+*/
+int dir_fd(struct dir_reader *dir) {
+    return dir->fd;
+}
+
+/*
+    Stops reading dir and closes its file descriptor.
+*/
+void dir_close(struct dir_reader *dir) {
+#ifdef DIR_GETDENTS
+    close(dir->fd);
+    free(dir->buf);
+#else
+    closedir(dir->dirp);
+#endif
+    free(dir);
+}
@@ -0,0 +1,30 @@
+#ifndef _DIR_READER_H_
+#define _DIR_READER_H_
+
+#include <sys/types.h>
+
+/*
+ * An entry of a directory returned by dir_next. name is only valid until
+ * the next call to dir_next or dir_close.
+ */
+struct dir_entry {
+    const char *name;
+    ino_t ino;
+    mode_t type;                 // S_IF* type, or 0 if not known.
+};
+
+/*
+ * A directory being read in big batches straight from the kernel (with
+ * getdents64 on Linux), rather than through readdir's small buffer.
+ */
+struct dir_reader;
+
+// Directory reading functions in dir_reader.c
+struct dir_reader *dir_open(int dirfd, const char *path);
+struct dir_reader *dir_fdopen(int fd);
+int dir_next(struct dir_reader *dir, struct dir_entry *entry);
+int dir_fd(struct dir_reader *dir);
+void dir_close(struct dir_reader *dir);
+void dir_set_buffer_size(size_t size);
+
+#endif // _DIR_READER_H_
@@ -3,7 +3,36 @@
 
 #define BLOCKSIZE 8
 
+/*
+ * Running state of a hash that is computed over data arriving in pieces.
+ * Passing a file's contents through hash_update in any number of calls
+ * gives the same digest as hash() over the whole file.
+ */
+struct hash_ctx {
+    char digest[BLOCKSIZE];
+    int index;                   // Next position of digest to fold into.
+};
+
+struct stat;
+
 // Hash manipulation helper functions
 char *hash(char* hash_val, FILE *f);
+void hash_init(struct hash_ctx *ctx);
+void hash_update(struct hash_ctx *ctx, const void *buf, size_t len);
+void hash_skip(struct hash_ctx *ctx, off_t len);
+void hash_final(struct hash_ctx *ctx, char *hash_val);
+int hash_fd(char *hash_val, int fd);
+char *hash_path(char *hash_val, const char *path);
+void *map_sequential(int fd, off_t offset, size_t len);
+int run_mapped(void (*fn)(void *), void *arg);
+int may_have_holes(const struct stat *info);
+off_t data_run(int fd, off_t *offset, off_t end);
+void hash_set_parallel(off_t threshold, int max_threads);
+int hash_set_kernel(const char *name);
+
+// Persistent cache of file hashes in hash_cache.c
+int hash_cache_get(const struct stat *info, char *hash_val);
+int hash_cache_put(int fd, const struct stat *info, const char *hash_val);
+char *hash_cached(char *hash_val, const char *path, const struct stat *info);
 
 #endif // _HASH_H_
@@ -1,25 +1,610 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "hash.h"
 
 #define BLOCK_SIZE 8
 
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define HASH_X86
+#endif
+
+// Number of bytes read from the file per fread call.
+#define HASH_READ_SIZE (64 * 1024)
+
+// Regular files at least this big are hashed straight out of the page cache
+// through mmap instead of being read into a buffer.
+#define HASH_MMAP_MIN (256 * 1024)
+
+// Amount of a file that is mapped at once, so huge files don't have to be
+// mapped (and populated) in one go. Must be a multiple of the page size.
+#define HASH_MAP_WINDOW (64 * 1024 * 1024)
+
+// Default size above which a regular file is split into ranges that are
+// hashed on separate threads, and the most threads used for one file.
+#define HASH_PARALLEL_MIN (512L * 1024 * 1024)
+#define HASH_MAX_THREADS 16
+
+// Smallest range handed to a thread, and the pread buffer each one uses.
+#define HASH_RANGE_MIN (64L * 1024 * 1024)
+#define HASH_RANGE_BUF (1024 * 1024)
+
+// Width of the lane accumulator used by the bulk kernels. Must be a
+// multiple of BLOCK_SIZE so that whole lanes fold back onto the digest.
+#define HASH_LANES 32
+
+typedef void (*fold_kernel)(unsigned char *lanes, const unsigned char *buf,
+                            size_t len);
+
+// Part of a file hashed by one thread of hash_parallel.
+struct hash_range {
+    int fd;
+    off_t base;                  // Offset the whole hash starts at.
+    off_t start;
+    off_t end;
+    int sparse;                  // Whether the file might have holes.
+    char digest[BLOCK_SIZE];
+    int error;                   // errno of a failed read, or 0.
+};
+
+static fold_kernel kernel = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+// Where run_mapped on this thread jumps back to if the file mapping it's
+// reading is truncated under it, or NULL outside run_mapped.
+static __thread sigjmp_buf *mapped_jump = NULL;
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+
+static off_t parallel_threshold = HASH_PARALLEL_MIN;
+static int parallel_max_threads = 0;
+
+
+/*
+    XOR-folds len bytes of buf into the 32 byte lanes accumulator, 8 bytes at
+    a time. len must be a multiple of HASH_LANES.
+*/
+static void fold_u64(unsigned char *lanes, const unsigned char *buf,
+                     size_t len) {
+    uint64_t acc[4];
+    memcpy(acc, lanes, sizeof(acc));
+    for(size_t i = 0; i < len; i += HASH_LANES) {
+        uint64_t word[4];
+        memcpy(word, buf + i, sizeof(word));
+        acc[0] ^= word[0];
+        acc[1] ^= word[1];
+        acc[2] ^= word[2];
+        acc[3] ^= word[3];
+    }
+    memcpy(lanes, acc, sizeof(acc));
+}
+
+#ifdef HASH_X86
+/*
+    SSE2 version of fold_u64, 16 bytes at a time.
+*/
+__attribute__((target("sse2")))
+static void fold_sse2(unsigned char *lanes, const unsigned char *buf,
+                      size_t len) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)lanes);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(lanes + 16));
+    for(size_t i = 0; i < len; i += HASH_LANES) {
+        lo = _mm_xor_si128(lo, _mm_loadu_si128((const __m128i *)(buf + i)));
+        hi = _mm_xor_si128(hi,
+                           _mm_loadu_si128((const __m128i *)(buf + i + 16)));
+    }
+    _mm_storeu_si128((__m128i *)lanes, lo);
+    _mm_storeu_si128((__m128i *)(lanes + 16), hi);
+}
+
+/*
+    AVX2 version of fold_u64, 32 bytes at a time. Four accumulators are used
+    so that consecutive loads don't wait on each other.
+*/
+__attribute__((target("avx2")))
+static void fold_avx2(unsigned char *lanes, const unsigned char *buf,
+                      size_t len) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)lanes);
+    __m256i a1 = _mm256_setzero_si256();
+    __m256i a2 = _mm256_setzero_si256();
+    __m256i a3 = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 4 * HASH_LANES <= len; i += 4 * HASH_LANES) {
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(buf + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(buf + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(buf + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(buf + i + 96)));
+    }
+    for(; i < len; i += HASH_LANES) {
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(buf + i)));
+    }
+    a0 = _mm256_xor_si256(_mm256_xor_si256(a0, a1), _mm256_xor_si256(a2, a3));
+    _mm256_storeu_si256((__m256i *)lanes, a0);
+}
+#endif
+
+/*
+    Picks the widest kernel the CPU we're running on supports.
+*/
+static void select_kernel(void) {
+    kernel = fold_u64;
+#ifdef HASH_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernel = fold_avx2;
+    }
+    else if(__builtin_cpu_supports("sse2")) {
+        kernel = fold_sse2;
+    }
+#endif
+}
+
+/*
+    Forces the fold kernel used from now on to "u64", "sse2" or "avx2",
+    or back to the best one for this CPU with "auto". Meant for
+    benchmarks; returns -1 if the kernel isn't available here.
+*/
+int hash_set_kernel(const char *name) {
+    pthread_once(&kernel_once, select_kernel);
+    if(strcmp(name, "auto") == 0) {
+        select_kernel();
+    }
+    else if(strcmp(name, "u64") == 0) {
+        kernel = fold_u64;
+    }
+#ifdef HASH_X86
+    else if(strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        kernel = fold_sse2;
+    }
+    else if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        kernel = fold_avx2;
+    }
+#endif
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    XORs len bytes of buf into hash_val, starting at position *index of the
+    digest. *index is updated so that consecutive calls continue the fold
+    where the previous one stopped.
+*/
+static void fold(char *hash_val, int *index, const unsigned char *buf,
+                 size_t len) {
+    pthread_once(&kernel_once, select_kernel);
+
+    // Bring the digest position back to 0 one byte at a time.
+    while(len > 0 && *index != 0) {
+        hash_val[*index] ^= *buf++;
+        len--;
+        *index = (*index + 1) % BLOCK_SIZE;
+    }
+
+    // Fold the bulk of the buffer in whole lanes. Since HASH_LANES is a
+    // multiple of BLOCK_SIZE the digest position is still 0 afterwards.
+    size_t bulk = len - len % HASH_LANES;
+    if(bulk > 0) {
+        unsigned char lanes[HASH_LANES] = {0};
+        kernel(lanes, buf, bulk);
+        for(int i = 0; i < HASH_LANES; i++) {
+            hash_val[i % BLOCK_SIZE] ^= lanes[i];
+        }
+        buf += bulk;
+        len -= bulk;
+    }
+
+    while(len > 0) {
+        hash_val[*index] ^= *buf++;
+        len--;
+        *index = (*index + 1) % BLOCK_SIZE;
+    }
+}
+
+/*
+    Resets ctx to the hash of an empty input.
+*/
+void hash_init(struct hash_ctx *ctx) {
+    memset(ctx->digest, '\0', BLOCK_SIZE);
+    ctx->index = 0;
+}
+
+/*
+    Folds the next len bytes of the input into ctx.
+*/
+void hash_update(struct hash_ctx *ctx, const void *buf, size_t len) {
+    fold(ctx->digest, &ctx->index, buf, len);
+}
+
+/*
+    Folds the next len bytes of the input into ctx as if they were all
+    zeros, which don't change the digest, so only its position moves on.
+    Lets holes in files be hashed without reading them.
+*/
+void hash_skip(struct hash_ctx *ctx, off_t len) {
+    ctx->index = (ctx->index + len % BLOCK_SIZE) % BLOCK_SIZE;
+}
+
+/*
+    Copies the digest of everything passed to hash_update so far into
+    hash_val, which must have room for BLOCK_SIZE bytes.
+*/
+void hash_final(struct hash_ctx *ctx, char *hash_val) {
+    memcpy(hash_val, ctx->digest, BLOCK_SIZE);
+}
+
+
+/*
+    Sets the size above which files are hashed by several threads at once,
+    and the most threads used for a single file. A max_threads of 0 uses one
+    thread per online CPU (up to HASH_MAX_THREADS).
+*/
+void hash_set_parallel(off_t threshold, int max_threads) {
+    parallel_threshold = threshold;
+    parallel_max_threads = max_threads;
+}
+
+/*
+    Returns the number of threads to split len bytes of a file between, or 1
+    if the file should be hashed on the calling thread.
+*/
+static int parallel_threads(off_t len) {
+    if(len < parallel_threshold) {
+        return 1;
+    }
+    long threads = parallel_max_threads;
+    if(threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if(threads > HASH_MAX_THREADS) {
+            threads = HASH_MAX_THREADS;
+        }
+    }
+    if(threads > len / HASH_RANGE_MIN) {
+        threads = len / HASH_RANGE_MIN;
+    }
+    return threads < 1 ? 1 : threads;
+}
+
+/*
+    Returns 1 if the regular file described by info has fewer blocks than
+    its size needs, so might have holes worth skipping.
+*/
+int may_have_holes(const struct stat *info) {
+    return S_ISREG(info->st_mode) && info->st_blocks * 512 < info->st_size;
+}
+
+/*
+    Moves *offset on past any hole of the file open on fd that starts there,
+    to the page the next data starts on (or to end), and returns where that
+    data ends, rounded up to a page (but no further than end). Holes read
+    as zeros, so what's skipped needn't be read. If holes can't be found,
+    the rest of the file is taken to be data. Moves the file position of
+    fd.
+*/
+off_t data_run(int fd, off_t *offset, off_t end) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t data = lseek(fd, *offset, SEEK_DATA);
+    if(data == -1) {
+        if(errno == ENXIO) { // Nothing but a hole from *offset on.
+            *offset = end;
+        }
+        return end;
+    }
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    data -= data % page;
+    if(data > *offset) {
+        *offset = data < end ? data : end;
+    }
+    if(hole == -1 || hole >= end) {
+        return end;
+    }
+    hole += (page - hole % page) % page;
+    return hole < end ? hole : end;
+}
+
+/*
+    Hashes one range of a file with pread. The fold starts at the position
+    of the digest the range's first byte falls on, so the digests of all the
+    ranges can simply be XORed together.
+*/
+static void *hash_range(void *arg) {
+    struct hash_range *range = arg;
+    struct hash_ctx ctx;
+    unsigned char *buf = malloc(HASH_RANGE_BUF);
+
+    hash_init(&ctx);
+    ctx.index = (range->start - range->base) % BLOCK_SIZE;
+    range->error = buf == NULL ? ENOMEM : 0;
+    off_t offset = range->start;
+    // End of the data being read, found at the start of each run of it.
+    off_t run_end = range->sparse ? range->start : range->end;
+    while(range->error == 0 && offset < range->end) {
+        if(offset == run_end) {
+            off_t hole = offset;
+            run_end = data_run(range->fd, &offset, range->end);
+            hash_skip(&ctx, offset - hole);
+            continue;
+        }
+        size_t len = HASH_RANGE_BUF;
+        if(run_end - offset < HASH_RANGE_BUF) {
+            len = run_end - offset;
+        }
+        ssize_t nread = pread(range->fd, buf, len, offset);
+        if(nread > 0) {
+            hash_update(&ctx, buf, nread);
+            offset += nread;
+        }
+        else if(nread == 0) {
+            range->error = EIO; // The file shrank under us.
+        }
+        else if(errno != EINTR) {
+            range->error = errno;
+        }
+    }
+    free(buf);
+    memcpy(range->digest, ctx.digest, BLOCK_SIZE);
+    return NULL;
+}
+
+/*
+    Computes the hash of bytes start to end of the file open on fd into
+    hash_val, split into 'threads' ranges that are hashed concurrently.
+    Returns 0 on success and -1 (with errno set) on error.
+*/
+static int hash_parallel(char *hash_val, int fd, off_t start, off_t end,
+                         int threads) {
+    struct hash_range ranges[HASH_MAX_THREADS];
+    pthread_t tids[HASH_MAX_THREADS];
+    int started[HASH_MAX_THREADS];
+    off_t len = end - start;
+    struct stat info;
+    int sparse = fstat(fd, &info) == 0 && may_have_holes(&info);
+    // Round ranges up to whole read buffers to keep reads aligned.
+    off_t step = (len / threads + HASH_RANGE_BUF - 1) / HASH_RANGE_BUF *
+                 HASH_RANGE_BUF;
+    int count = 0;
+
+    for(off_t offset = start; offset < end && count < threads; count++) {
+        ranges[count].fd = fd;
+        ranges[count].base = start;
+        ranges[count].start = offset;
+        ranges[count].end = count == threads - 1 || end - offset < step ?
+                            end : offset + step;
+        ranges[count].sparse = sparse;
+        offset = ranges[count].end;
+        started[count] = pthread_create(&tids[count], NULL, hash_range,
+                                        &ranges[count]) == 0;
+        // Hash the range here if we couldn't get another thread for it.
+        if(!started[count]) {
+            hash_range(&ranges[count]);
+        }
+    }
+
+    int error = 0;
+    memset(hash_val, '\0', BLOCK_SIZE);
+    for(int i = 0; i < count; i++) {
+        if(started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+        if(ranges[i].error != 0) {
+            error = ranges[i].error;
+        }
+        for(int j = 0; j < BLOCK_SIZE; j++) {
+            hash_val[j] ^= ranges[i].digest[j];
+        }
+    }
+    if(error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+
 char *hash(char *hash_val, FILE *f) {
-    char ch;
-    int hash_index = 0;
+    unsigned char buf[HASH_READ_SIZE];
+    size_t nread;
+    struct hash_ctx ctx;
 
-    for (int index = 0; index < BLOCK_SIZE; index++) {
-        hash_val[index] = '\0';
+    // Split big regular files between threads, leaving f at the end of the
+    // file as if it had been read through.
+    struct stat info;
+    off_t start = ftello(f);
+    if(start != -1 && fstat(fileno(f), &info) == 0 &&
+       S_ISREG(info.st_mode) && info.st_size > start) {
+        int threads = parallel_threads(info.st_size - start);
+        if(threads > 1 &&
+           hash_parallel(hash_val, fileno(f), start, info.st_size,
+                         threads) == 0) {
+            fseeko(f, 0, SEEK_END);
+            return hash_val;
+        }
     }
 
-    while(fread(&ch, 1, 1, f) != 0) {
-        hash_val[hash_index] ^= ch;
-        hash_index = (hash_index + 1) % BLOCK_SIZE;
+    hash_init(&ctx);
+    while((nread = fread(buf, 1, HASH_READ_SIZE, f)) != 0) {
+        hash_update(&ctx, buf, nread);
     }
+    hash_final(&ctx, hash_val);
 
     return hash_val;
 }
 
 
+/*
+    Maps len bytes of fd starting at offset read-only, populated up front
+    and advised for a single sequential pass. offset must be a multiple of
+    the page size. Returns MAP_FAILED on error.
+*/
+void *map_sequential(int fd, off_t offset, size_t len) {
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void *map = mmap(NULL, len, PROT_READ, flags, fd, offset);
+    if(map != MAP_FAILED) {
+        madvise(map, len, MADV_SEQUENTIAL);
+    }
+    return map;
+}
+
+/*
+    Abandons the run_mapped call of this thread, if any, when touching a
+    page of a mapping past the end of its file raised SIGBUS. Otherwise the
+    signal gets its default action: it's raised again, and delivered once
+    this returns.
+*/
+static void on_sigbus(int sig) {
+    if(mapped_jump != NULL) {
+        siglongjmp(*mapped_jump, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+    Handles SIGBUS with on_sigbus, unless the program handles it already.
+*/
+static void install_sigbus(void) {
+    struct sigaction action, old;
+    if(sigaction(SIGBUS, NULL, &old) != 0 || old.sa_handler != SIG_DFL) {
+        return;
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigbus;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+/*
+    Calls fn(arg), which reads from file mappings (see map_sequential), and
+    returns 0. If another process truncates a file while fn reads past its
+    new end, the kernel raises SIGBUS, which would kill the process. fn is
+    abandoned where it was instead and -1 is returned with errno set to EIO,
+    as when a read comes up short, so fn mustn't take locks or allocate
+    memory. Only a program with its own SIGBUS handler is left to handle it.
+*/
+int run_mapped(void (*fn)(void *), void *arg) {
+    sigjmp_buf jump;
+    sigjmp_buf *outer = mapped_jump;
+    pthread_once(&sigbus_once, install_sigbus);
+    if(sigsetjmp(jump, 1) != 0) {
+        mapped_jump = outer;
+        errno = EIO;
+        return -1;
+    }
+    mapped_jump = &jump;
+    fn(arg);
+    mapped_jump = outer;
+    return 0;
+}
+
+/*
+    Folds a mapped window of a file into a hash, under run_mapped.
+*/
+struct mapped_fold {
+    struct hash_ctx *ctx;
+    const void *map;
+    size_t len;
+};
+
+static void fold_mapped(void *arg) {
+    struct mapped_fold *fold = arg;
+    hash_update(fold->ctx, fold->map, fold->len);
+}
+
+/*
+    Computes the hash of the file open on fd into hash_val. Huge regular
+    files are split into ranges hashed on separate threads. Big regular
+    files are folded straight out of the page cache through mmap; pipes,
+    sockets and small files are read in HASH_READ_SIZE chunks instead.
+    Holes in regular files are skipped rather than read. A file that
+    shrinks while it's mapped or split is an error (EIO).
+    Returns 0 on success and -1 (with errno set) on error.
+*/
+int hash_fd(char *hash_val, int fd) {
+    struct hash_ctx ctx;
+    struct stat info;
+    hash_init(&ctx);
+
+    int regular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+    int threads = regular ? parallel_threads(info.st_size) : 1;
+    if(threads > 1) {
+        return hash_parallel(hash_val, fd, 0, info.st_size, threads);
+    }
+    else if(regular && info.st_size >= HASH_MMAP_MIN) {
+        int sparse = may_have_holes(&info);
+        off_t offset = 0;
+        while(offset < info.st_size) {
+            // Only map the runs of data of a file with holes.
+            off_t hole = offset;
+            off_t run_end = sparse ? data_run(fd, &offset, info.st_size) :
+                                     info.st_size;
+            hash_skip(&ctx, offset - hole);
+            for(; offset < run_end; offset += HASH_MAP_WINDOW) {
+                size_t len = HASH_MAP_WINDOW;
+                if(run_end - offset < HASH_MAP_WINDOW) {
+                    len = run_end - offset;
+                }
+                void *map = map_sequential(fd, offset, len);
+                if(map == MAP_FAILED) {
+                    return -1;
+                }
+                struct mapped_fold fold = {&ctx, map, len};
+                int ret = run_mapped(fold_mapped, &fold);
+                munmap(map, len);
+                if(ret != 0) {
+                    return -1; // The file shrank under us.
+                }
+            }
+            offset = run_end;
+        }
+    }
+    else {
+        unsigned char buf[HASH_READ_SIZE];
+        ssize_t nread;
+        while((nread = read(fd, buf, HASH_READ_SIZE)) != 0) {
+            if(nread == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            hash_update(&ctx, buf, nread);
+        }
+    }
+
+    hash_final(&ctx, hash_val);
+    return 0;
+}
+
+/*
+    Computes the hash of the file at path into hash_val.
+    Returns hash_val, or NULL if the file couldn't be read.
+*/
+char *hash_path(char *hash_val, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return NULL;
+    }
+    int ret = hash_fd(hash_val, fd);
+    close(fd);
+    return ret == 0 ? hash_val : NULL;
+}
+
+
 int check_hash(const char *hash1, const char *hash2) {
     for (long i = 0; i < BLOCK_SIZE; i++) {
         if (hash1[i] != hash2[i]) {
@@ -9,8 +9,10 @@
 #include <sys/wait.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include "ftree.h"
 #include "hash.h"
+#include "dir_reader.h"
 
 
 #ifndef PORT
@@ -94,7 +96,7 @@ int traverse_dir(char* server_path, char* client_path, char* host, int soc,
                  unsigned short port) {
 
     struct stat dir_info, item_info;
-    struct dirent* dp;
+    struct dir_entry entry;
     int status;
     int type = REGDIR;
 
@@ -118,39 +120,38 @@ int traverse_dir(char* server_path, char* client_path, char* host, int soc,
 
     // Check if there was a type mismatch between client and server.
     if(status != ERROR) {
-        DIR *dirp = opendir(client_path);
-        if(dirp == NULL) {
+        struct dir_reader *dir = dir_open(AT_FDCWD, client_path);
+        if(dir == NULL) {
             perror("Directory doesn't exist");
             return -1;
         }
-        errno = 0;
-        dp = readdir(dirp);
-        /*
-            Value of dp could be NULL if dirp has no items. Explicit check
-            of errno is required and errno has been set to 0 before readdir to
-            account for any previous errors.
-        */
-        if(errno != 0 && dp == NULL) {
-            perror("readdir");
-        }
+        int ret;
 
-        while(dp != NULL) {
+        while((ret = dir_next(dir, &entry)) == 1) {
 
-            if(dp->d_name[0] != '.') {
+            if(entry.name[0] != '.') {
 
-                int item_path_len = strlen(client_path) + strlen(dp->d_name) +
+                int item_path_len = strlen(client_path) + strlen(entry.name) +
                                     2;
-                char *item_path = get_path(client_path, dp->d_name,
+                char *item_path = get_path(client_path, entry.name,
                                            item_path_len);
 
-                if ((lstat(item_path, &item_info) != 0)) {
+                /*
+                    The directory entry usually carries the item's type, so
+                    only items of unknown type need an lstat here.
+                */
+                item_info.st_mode = entry.type;
+                if (entry.type == 0 &&
+                    fstatat(dir_fd(dir), entry.name, &item_info,
+                            AT_SYMLINK_NOFOLLOW) != 0) {
                     perror("lstat");
+                    dir_close(dir);
                     return -1;
                 }
 
-                int path_len = strlen(server_path) + strlen(dp->d_name) +
+                int path_len = strlen(server_path) + strlen(entry.name) +
                                     2;
-                char *path = get_path(server_path, dp->d_name, path_len);
+                char *path = get_path(server_path, entry.name, path_len);
 
                 if(S_ISDIR(item_info.st_mode)) {
                     printf("one dir\n");
@@ -161,9 +162,12 @@ int traverse_dir(char* server_path, char* client_path, char* host, int soc,
                     client_file_handler(path, item_path, host, soc, port);
                 }
             }
-            dp = readdir(dirp);
 
         }
+        if(ret == -1) {
+            perror("readdir");
+        }
+        dir_close(dir);
 
     }
     else { //Type mismatch between client and server. Return error.
@@ -191,13 +195,10 @@ int client_file_handler(char* server_path, char* client_path, char* host,
     char *file_hash = malloc(sizeof(char)*BLOCKSIZE);
     // Make sure we have proper permissions to copy file.
     chmod(client_path, 00777);
-    FILE *f = fopen(client_path,"r");
-    if (f == NULL) {
-        perror("File couldn't be opened");
+    if (hash_path(file_hash, client_path) == NULL) {
+        perror("File couldn't be hashed");
         return -1;
     }
-    hash(file_hash, f);
-    fclose(f);
     //Reset permissions of file in server.
     chmod(client_path, file_info.st_mode);
 
@@ -300,14 +301,27 @@ int transfer_file(char* server_path, char* client_path, char* host, char* file_h
         perror("File couldn't be opened");
         return -1;
     }
-    char buf;
-    while (fread(&buf, sizeof(char), 1, f) != 0) {
-        write(trans_soc, &buf, sizeof(char));
-        printf("%c\n", buf);
+    // Hash the data as it's sent so we can tell if the file changed after
+    // file_hash was computed.
+    char buf[MAXDATA];
+    char sent_hash[BLOCKSIZE];
+    struct hash_ctx ctx;
+    size_t nread;
+    hash_init(&ctx);
+    while ((nread = fread(buf, sizeof(char), MAXDATA, f)) != 0) {
+        hash_update(&ctx, buf, nread);
+        if(write(trans_soc, buf, nread) != nread) {
+            perror("write");
+            break;
+        }
     }
     if(fclose(f) == EOF) {
         perror("File close");
     }
+    hash_final(&ctx, sent_hash);
+    if(memcmp(sent_hash, file_hash, BLOCKSIZE) != 0) {
+        printf("%s changed while it was being transferred.\n", client_path);
+    }
 
     // //Wait for message back from server.
     // if(read(trans_soc, &status, sizeof(int)) == 0) {
@@ -288,20 +288,44 @@ int handleclient(struct client *p, char *path) {
     }
 
     if(p->curr_state == AWAITING_DATA) {
-        char buf;
+        char buf[MAXDATA];
+        char data_hash[BLOCKSIZE];
+        struct hash_ctx ctx;
+        ssize_t nread;
+        int t = OK;
         FILE *server_file = fopen(p->rq.path, "w");
         if(server_file == NULL) {
             perror("fopen");
+            t = ERROR;
+            write(p->fd, &t, sizeof(int));
+            return -1;
         }
-        while(read(p->fd, &buf, sizeof(char)) == 1) {
-            if(fwrite(&buf, sizeof(char), 1, server_file) != 1) {
+        // Hash the data as it arrives and check it against the hash the
+        // client sent.
+        hash_init(&ctx);
+        while((nread = read(p->fd, buf, MAXDATA)) > 0) {
+            hash_update(&ctx, buf, nread);
+            if(fwrite(buf, sizeof(char), nread, server_file) != nread) {
                 perror("Fwrite failed");
+                t = ERROR;
                 break;
             }
-            printf("%c\n", buf);
         }
         fclose(server_file);
-        int t = OK;
+        hash_final(&ctx, data_hash);
+        if(memcmp(data_hash, p->rq.hash, BLOCKSIZE) != 0) {
+            printf("Data received for %s doesn't match its hash.\n",
+                   p->rq.path);
+            t = ERROR;
+        }
+        else if(t == OK) {
+            // Remember the hash of the new file so an unchanged copy isn't
+            // read again when the client next compares against it.
+            struct stat info;
+            if(stat(p->rq.path, &info) == 0) {
+                hash_cache_put(-1, &info, data_hash);
+            }
+        }
         write(p->fd, &t, sizeof(int));
         return -1;
     }
@@ -361,24 +385,31 @@ int server_file_handler(struct client *p) {
             return 1;
         }
         else {
-            chmod(p->rq.path, 00777);
+            // A current hash from the hash cache saves reading the file, and
+            // chmod-ing it (which would invalidate the cache entry).
+            char *server_file_hash = malloc(sizeof(char)*BLOCKSIZE);
+            int cached = p->rq.size == server_file.st_size &&
+                         hash_cache_get(&server_file, server_file_hash);
+            if(!cached) {
+                chmod(p->rq.path, 00777);
+            }
             if(p->rq.size == server_file.st_size) {
-                FILE *server_f = fopen(p->rq.path, "r");
-                // Return error if the file on the server doesn't have necessary
-                // permissions.
-                if(server_f == NULL) {
+                // Compute hash if files have same size. Return error if the
+                // file on the server doesn't have necessary permissions.
+                if(!cached && (lstat(p->rq.path, &server_file) != 0 ||
+                               hash_cached(server_file_hash, p->rq.path,
+                                           &server_file) == NULL)) {
                     perror("File in server can't be opened");
+                    free(server_file_hash);
                     return 1;
                 }
-                // Compute hash if files have same size.
-                char *server_file_hash = malloc(sizeof(char)*BLOCKSIZE);
-                hash(server_file_hash, server_f);
-                fclose(server_f);
 
                 if(strcmp(p->rq.hash, server_file_hash) == 0) {
+                    free(server_file_hash);
                     return 0;
                 }
             }
+            free(server_file_hash);
         }
     }
     return 0;
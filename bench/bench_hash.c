@@ -0,0 +1,360 @@
+/*
+ * Throughput benchmark for the hash functions in hash_functions.c.
+ *
+ * "make bench" in each assignment builds this against that assignment's
+ * hash_functions.c with -O2 and runs it. Assignment 1 builds it with
+ * -DCOMPUTE_HASH, since its hash works on any block size and reads from a
+ * stream; the other assignments share the same 8 byte hash API.
+ *
+ * Usage: bench_hash [MAX_SIZE [DIR]]
+ *     MAX_SIZE - largest input to time, with an optional K, M or G suffix
+ *                (default 1G). Sizes go up by 16x from 4K.
+ *     DIR      - where the temporary input file is created (default .)
+ *
+ * For each implementation and size this prints the throughput in GB/s,
+ * the CPU cycles per byte (from the time stamp counter, so only on x86)
+ * and the read system calls made per MB hashed (from /proc/self/io).
+ * The "file mmap" and "file threaded" rows only start at the sizes that
+ * hash_fd first maps and splits between threads at. Files are timed hot,
+ * right after being written; drop the page cache first to measure cold
+ * reads.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define BENCH_TSC
+#endif
+
+#ifdef COMPUTE_HASH
+    // Hash manipulation functions in hash_functions.c
+    void hash_stream(char *hash_val, long block_size, FILE *f);
+    int hash_set_kernel(const char *name);
+    #define DIGEST_MAX (1024 * 1024)
+#else
+    #include "hash.h"
+    #ifdef BLOCK_SIZE
+        #define DIGEST_MAX BLOCK_SIZE
+    #else
+        #define DIGEST_MAX BLOCKSIZE
+    #endif
+#endif
+
+// Spend at least this long timing each implementation at each size.
+#define MIN_SECONDS 0.25
+
+// The byte at a time reference is skipped above this size.
+#define BYTEWISE_MAX (64L * 1024 * 1024)
+
+#define READ_SIZE (64 * 1024)
+
+// Smallest inputs hash_fd maps rather than reads, and splits between
+// threads (two ranges of HASH_RANGE_MIN). They mirror HASH_MMAP_MIN and
+// HASH_RANGE_MIN in hash_functions.c; below them the "file mmap" and
+// "file threaded" rows would time a different path from the one named,
+// so they're skipped.
+#define MMAP_MIN (256 * 1024)
+#define THREADED_MIN (2 * 64L * 1024 * 1024)
+
+// What an implementation is timed on.
+struct input {
+    const unsigned char *buf;   // The data, in memory.
+    const char *path;           // The same data, in a file.
+    size_t len;
+    long block_size;
+};
+
+struct impl {
+    const char *name;
+    const char *kernel;         // Kernel to force, or NULL.
+    int from_file;
+    void (*run)(const struct input *in, char *hash_val);
+    size_t min_len;             // Smallest input it's timed on.
+};
+
+static char hash_val[DIGEST_MAX];
+
+
+/*
+ * Folds the input one byte at a time, the way hash() used to.
+ */
+static void run_bytewise_mem(const struct input *in, char *hash_val) {
+    long index = 0;
+    memset(hash_val, '\0', in->block_size);
+    for(size_t i = 0; i < in->len; i++) {
+        hash_val[index] ^= in->buf[i];
+        index = (index + 1) % in->block_size;
+    }
+}
+
+static void run_bytewise_file(const struct input *in, char *hash_val) {
+    FILE *f = fopen(in->path, "r");
+    char byte;
+    long index = 0;
+    memset(hash_val, '\0', in->block_size);
+    while(fread(&byte, sizeof(char), 1, f) != 0) {
+        hash_val[index] ^= byte;
+        index = (index + 1) % in->block_size;
+    }
+    fclose(f);
+}
+
+#ifdef COMPUTE_HASH
+
+static void run_stream_mem(const struct input *in, char *hash_val) {
+    FILE *f = fmemopen((void *)in->buf, in->len, "r");
+    memset(hash_val, '\0', in->block_size);
+    hash_stream(hash_val, in->block_size, f);
+    fclose(f);
+}
+
+static void run_stream_file(const struct input *in, char *hash_val) {
+    FILE *f = fopen(in->path, "r");
+    memset(hash_val, '\0', in->block_size);
+    hash_stream(hash_val, in->block_size, f);
+    fclose(f);
+}
+
+static const struct impl impls[] = {
+    {"byte-wise", NULL, 0, run_bytewise_mem},
+    {"u64", "u64", 0, run_stream_mem},
+    {"sse2", "sse2", 0, run_stream_mem},
+    {"avx2", "avx2", 0, run_stream_mem},
+    {"file byte-wise", NULL, 1, run_bytewise_file},
+    {"file buffered", "auto", 1, run_stream_file},
+};
+
+static const long block_sizes[] = {1, 8, 13, 32, 1000, 4096, 1024 * 1024};
+
+#else
+
+static void run_update(const struct input *in, char *hash_val) {
+    struct hash_ctx ctx;
+    hash_init(&ctx);
+    hash_update(&ctx, in->buf, in->len);
+    hash_final(&ctx, hash_val);
+}
+
+static void run_buffered(const struct input *in, char *hash_val) {
+    unsigned char buf[READ_SIZE];
+    struct hash_ctx ctx;
+    ssize_t nread;
+    int fd = open(in->path, O_RDONLY);
+    hash_init(&ctx);
+    while((nread = read(fd, buf, READ_SIZE)) > 0) {
+        hash_update(&ctx, buf, nread);
+    }
+    hash_final(&ctx, hash_val);
+    close(fd);
+}
+
+static void run_mmap(const struct input *in, char *hash_val) {
+    int fd = open(in->path, O_RDONLY);
+    hash_set_parallel((off_t)1 << 62, 1);
+    hash_fd(hash_val, fd);
+    close(fd);
+}
+
+static void run_threaded(const struct input *in, char *hash_val) {
+    int fd = open(in->path, O_RDONLY);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    hash_set_parallel(0, cpus > 2 ? cpus : 2);
+    hash_fd(hash_val, fd);
+    close(fd);
+}
+
+static const struct impl impls[] = {
+    {"byte-wise", NULL, 0, run_bytewise_mem},
+    {"u64", "u64", 0, run_update},
+    {"sse2", "sse2", 0, run_update},
+    {"avx2", "avx2", 0, run_update},
+    {"file byte-wise", NULL, 1, run_bytewise_file},
+    {"file buffered", "auto", 1, run_buffered},
+    {"file mmap", "auto", 1, run_mmap, MMAP_MIN},
+    {"file threaded", "auto", 1, run_threaded, THREADED_MIN},
+};
+
+static const long block_sizes[] = {DIGEST_MAX};
+
+#endif
+
+
+static double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t cycles_now(void) {
+#ifdef BENCH_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Returns the number of read system calls this process has made, or -1 if
+ * /proc/self/io isn't available.
+ */
+static long read_syscalls(void) {
+    FILE *f = fopen("/proc/self/io", "r");
+    char line[128];
+    long count = -1;
+    if(f == NULL) {
+        return -1;
+    }
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if(sscanf(line, "syscr: %ld", &count) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+static size_t parse_size(const char *str) {
+    char *end;
+    size_t size = strtoull(str, &end, 10);
+    switch(*end) {
+    case 'G': case 'g':
+        size *= 1024;
+        // fall through
+    case 'M': case 'm':
+        size *= 1024;
+        // fall through
+    case 'K': case 'k':
+        size *= 1024;
+    }
+    return size;
+}
+
+static void format_size(char *out, size_t size) {
+    const char *units = "BKMG";
+    while(size >= 1024 && size % 1024 == 0 && units[1] != '\0') {
+        size /= 1024;
+        units++;
+    }
+    sprintf(out, "%zu%c", size, *units);
+}
+
+/*
+ * Times impl on in, repeating it until MIN_SECONDS have passed, and prints
+ * one line of results.
+ */
+static void time_impl(const struct impl *impl, const struct input *in) {
+    char size[32];
+    double start, elapsed;
+    uint64_t cycles;
+    long reads;
+    long reps = 0;
+
+    if(impl->kernel != NULL && hash_set_kernel(impl->kernel) != 0) {
+        return;
+    }
+    if(strstr(impl->name, "byte-wise") != NULL && in->len > BYTEWISE_MAX) {
+        return;
+    }
+    if(in->len < impl->min_len) {
+        return;
+    }
+
+    reads = read_syscalls();
+    cycles = cycles_now();
+    start = seconds_now();
+    do {
+        impl->run(in, hash_val);
+        reps++;
+        elapsed = seconds_now() - start;
+    } while(elapsed < MIN_SECONDS);
+    cycles = cycles_now() - cycles;
+    reads = reads == -1 ? -1 : read_syscalls() - reads;
+
+    double bytes = (double)in->len * reps;
+    format_size(size, in->len);
+    printf("%-16s %8ld %6s %10.3f", impl->name, in->block_size, size,
+           bytes / elapsed / 1e9);
+#ifdef BENCH_TSC
+    printf(" %10.3f", cycles / bytes);
+#else
+    printf(" %10s", "n/a");
+#endif
+    if(reads == -1) {
+        printf(" %10s\n", "n/a");
+    }
+    else {
+        printf(" %10.2f\n", reads / (bytes / (1024 * 1024)));
+    }
+    fflush(stdout);
+}
+
+
+int main(int argc, char **argv) {
+    size_t max_size = argc > 1 ? parse_size(argv[1]) : parse_size("1G");
+    const char *dir = argc > 2 ? argv[2] : ".";
+
+    if(max_size < 4096) {
+        printf("Usage:\n\tbench_hash [MAX_SIZE [DIR]]\n");
+        return 1;
+    }
+
+    unsigned char *buf = malloc(max_size);
+    if(buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    // Fill the input with something that doesn't compress or repeat.
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for(size_t i = 0; i < max_size; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        buf[i] = state;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_hash.XXXXXX", dir);
+    int fd = mkstemp(path);
+    if(fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+
+    printf("%-16s %8s %6s %10s %10s %10s\n", "impl", "block", "size",
+           "GB/s", "cycles/B", "reads/MB");
+    size_t written = 0;
+    for(size_t len = 4096; len <= max_size; len *= 16) {
+        // Extend the file to len bytes.
+        while(written < len) {
+            ssize_t n = write(fd, buf + written, len - written);
+            if(n == -1) {
+                perror("write");
+                unlink(path);
+                return 1;
+            }
+            written += n;
+        }
+        for(size_t b = 0; b < sizeof(block_sizes) / sizeof(long); b++) {
+            struct input in = {buf, path, len, block_sizes[b]};
+            for(size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+                time_impl(&impls[i], &in);
+            }
+        }
+    }
+
+    close(fd);
+    unlink(path);
+    free(buf);
+    return 0;
+}